@@ -0,0 +1,280 @@
+// Copyright (C) 2020  Aleksey Romanov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Benchmark: reserved blocks consumed per recovered allocation failure
+//
+// Init() runs on the main thread while the leak runs on worker threads,
+// each allocating from its own glibc arena. Workers take turns so every
+// change of the available block count is attributed to one allocation.
+//
+// A run ends when the reserve is exhausted, so each run is a forked child
+// that reports its counts through a pipe. Blocks are at least as large as
+// chunks by default: a released block can cover a failure on its own, so
+// the ideal is 1 block per recovered failure.
+//
+
+#include <getopt.h>
+#include <simple_new_handler.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+static size_t const KB = 1024;
+static size_t const MB = 1024 * 1024;
+
+// Counts of one run
+struct Result {
+  size_t recovered_count;
+  size_t consumed_count;
+  size_t pending_count;
+};
+
+static std::mutex turn;
+static Result result = {0, 0, 0};
+static int result_fd = -1;
+
+static void TerminateHandler() {
+  // Reserve is exhausted, report to the parent and exit
+  ssize_t res = write(result_fd, &result, sizeof(result));
+  _exit(res == sizeof(result) ? 0 : 1);
+}
+
+static void Worker(size_t chunk_size) {
+  for (;;) {
+    std::lock_guard<std::mutex> lock(turn);
+
+    size_t before = simple::NewHandler::GetState().available_block_count;
+
+    // If this allocation terminates the process it took all of them
+    result.pending_count = before;
+
+    char* p = new char[chunk_size];
+    *p = 'a';  // Map allocated block
+
+    size_t after = simple::NewHandler::GetState().available_block_count;
+
+    if (after < before) {
+      result.recovered_count++;
+      result.consumed_count += before - after;
+    }
+  }
+}
+
+// Child process: leak until terminate() reports the result
+//
+static void Run(size_t limit, size_t thread_count, size_t chunk_size,
+                size_t block_count, size_t block_size, bool use_mmap) {
+  // Threads have to exist before the limit is set
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count);
+
+  std::set_terminate(TerminateHandler);
+
+  rlimit rl = {limit * MB, limit * MB};
+
+  int res = setrlimit(RLIMIT_AS, &rl);
+  assert(res == 0);
+
+  if (use_mmap) {
+    simple::NewHandler::SetReserveMode(simple::NewHandler::ReserveMode::kMmap);
+  }
+
+  simple::NewHandler::Init(1024, block_count, block_size);
+
+  {
+    // Hold workers until all of them are started
+    std::lock_guard<std::mutex> lock(turn);
+
+    for (size_t ii = 0; ii < thread_count; ii++) {
+      threads.emplace_back(Worker, chunk_size);
+    }
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // Should not be here
+  _exit(2);
+}
+
+// Print min/median/max of the values
+//
+static void Summary(char const* name, std::vector<double> values) {
+  std::cout << "  " << name << ": ";
+
+  if (values.empty()) {
+    std::cout << "none\n";
+    return;
+  }
+
+  std::sort(values.begin(), values.end());
+
+  size_t mid = values.size() / 2;
+  double median = values.size() % 2
+                      ? values[mid]
+                      : (values[mid - 1] + values[mid]) / 2;
+
+  std::cout << "min " << values.front() << ", median " << median << ", max "
+            << values.back() << "\n";
+}
+
+static void usage() {
+  std::cout << "usage: bench_arena [--mmap] [--runs n] [--threads n] "
+               "[--chunk kbs] [--blocks n] [--block kbs] "
+               "[memory-limit-in-mbs]\n";
+  std::cout << "\n";
+}
+
+int main(int argc, char** argv) {
+  size_t limit = 512;
+  size_t run_count = 10;
+  size_t thread_count = 8;
+  size_t chunk_size = 200 * KB;
+  size_t block_count = 64;
+  size_t block_size = 256 * KB;
+  bool use_mmap = false;
+
+  static struct option long_options[] = {{"mmap", no_argument, 0, 'm'},
+                                         {"runs", required_argument, 0, 'r'},
+                                         {"threads", required_argument, 0, 't'},
+                                         {"chunk", required_argument, 0, 'c'},
+                                         {"blocks", required_argument, 0, 'n'},
+                                         {"block", required_argument, 0, 'b'},
+                                         {"help", no_argument, 0, 'h'},
+                                         {0, 0, 0, 0}};
+
+  for (;;) {
+    int c = getopt_long(argc, argv, "mr:t:c:n:b:h", long_options, 0);
+
+    if (c < 0) {
+      break;
+    }
+
+    switch (c) {
+      case 'm':
+        use_mmap = true;
+        break;
+
+      case 'r':
+        run_count = strtoul(optarg, 0, 0);
+        break;
+
+      case 't':
+        thread_count = strtoul(optarg, 0, 0);
+        break;
+
+      case 'c':
+        chunk_size = strtoul(optarg, 0, 0) * KB;
+        break;
+
+      case 'n':
+        block_count = strtoul(optarg, 0, 0);
+        break;
+
+      case 'b':
+        block_size = strtoul(optarg, 0, 0) * KB;
+        break;
+
+      case 'h':
+        usage();
+        return 0;
+
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (optind < argc) {
+    limit = strtoul(argv[optind], 0, 0);
+  }
+
+  if (!run_count || !thread_count || !chunk_size || !block_count ||
+      !block_size || !limit) {
+    usage();
+    return 1;
+  }
+
+  std::vector<double> recovered;
+  std::vector<double> burnt;
+  std::vector<double> ratio;
+
+  for (size_t ii = 0; ii < run_count; ii++) {
+    int fds[2];
+
+    int res = pipe(fds);
+    assert(res == 0);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0) {
+      close(fds[0]);
+      result_fd = fds[1];
+
+      Run(limit, thread_count, chunk_size, block_count, block_size, use_mmap);
+    }
+
+    close(fds[1]);
+
+    Result run;
+    ssize_t len = read(fds[0], &run, sizeof(run));
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    if (len != sizeof(run)) {
+      std::cout << "run " << ii << " failed, status " << status << "\n";
+      return 1;
+    }
+
+    recovered.push_back(static_cast<double>(run.recovered_count));
+    burnt.push_back(static_cast<double>(run.pending_count));
+
+    if (run.recovered_count) {
+      ratio.push_back(static_cast<double>(run.consumed_count) /
+                      run.recovered_count);
+    }
+  }
+
+  std::cout << (use_mmap ? "mmap" : "heap") << ": " << run_count << " runs, "
+            << thread_count << " threads, " << chunk_size / KB
+            << "KB chunks, " << block_count << " x " << block_size / KB
+            << "KB blocks, " << limit << "MB limit\n";
+
+  Summary("recovered failures", recovered);
+  Summary("blocks burnt by the failure that terminated", burnt);
+  Summary("blocks per recovered failure", ratio);
+
+  return 0;
+}
@@ -0,0 +1,317 @@
+// Copyright (C) 2020  Aleksey Romanov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Interposition shim: route failures of malloc(), mmap() and
+// pthread_create() into the reserve of the handler and retry
+//
+// Built as a shared object for LD_PRELOAD, or with
+// SIMPLE_NEW_HANDLER_SHIM_WRAP as an object linked with
+// -Wl,--wrap=malloc,--wrap=calloc,... (see Makefile for the list).
+//
+// The reserve belongs to the copy of the handler that called Init(),
+// the shim forwards to it. A program that does not call Init() gets
+// a reserve from the shim when SIMPLE_NEW_HANDLER_RESERVE_COUNT and
+// SIMPLE_NEW_HANDLER_RESERVE_SIZE are set. glibc only.
+//
+
+#include <pthread.h>
+#include <simple_new_handler.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+#ifndef __GLIBC__
+#error "The shim needs glibc"
+#endif
+
+#define SHIM_EXPORT extern "C" __attribute__((visibility("default")))
+
+#ifdef SIMPLE_NEW_HANDLER_SHIM_WRAP
+
+#define SHIM(name) __wrap_##name
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void* __real_memalign(size_t alignment, size_t size);
+int __real_posix_memalign(void** ptr, size_t alignment, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+void* __real_mmap(void* addr, size_t len, int prot, int flags, int fd,
+                  off_t offset);
+int __real_pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                          void* (*start)(void*), void* arg);
+}
+
+static void* RealMalloc(size_t size) { return __real_malloc(size); }
+
+static void* RealCalloc(size_t count, size_t size) {
+  return __real_calloc(count, size);
+}
+
+static void* RealRealloc(void* ptr, size_t size) {
+  return __real_realloc(ptr, size);
+}
+
+static void* RealMemalign(size_t alignment, size_t size) {
+  return __real_memalign(alignment, size);
+}
+
+static void* RealMmap(void* addr, size_t len, int prot, int flags, int fd,
+                      off_t offset) {
+  return __real_mmap(addr, len, prot, flags, fd, offset);
+}
+
+static int RealPthreadCreate(pthread_t* thread, const pthread_attr_t* attr,
+                             void* (*start)(void*), void* arg) {
+  return __real_pthread_create(thread, attr, start, arg);
+}
+
+#else
+
+#define SHIM(name) name
+
+// glibc entry points behind the public names
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+}
+
+using PthreadCreate = int (*)(pthread_t*, const pthread_attr_t*,
+                              void* (*)(void*), void*);
+
+static PthreadCreate real_pthread_create = nullptr;
+
+static void* RealMalloc(size_t size) { return __libc_malloc(size); }
+
+static void* RealCalloc(size_t count, size_t size) {
+  return __libc_calloc(count, size);
+}
+
+static void* RealRealloc(void* ptr, size_t size) {
+  return __libc_realloc(ptr, size);
+}
+
+static void* RealMemalign(size_t alignment, size_t size) {
+  return __libc_memalign(alignment, size);
+}
+
+static void* RealMmap(void* addr, size_t len, int prot, int flags, int fd,
+                      off_t offset) {
+#if defined(SYS_mmap) && defined(__LP64__)
+  // Raw system call, the libc one is what is interposed
+  return reinterpret_cast<void*>(
+      syscall(SYS_mmap, addr, len, prot, flags, fd, offset));
+#else
+#error "The shim needs 64-bit Linux"
+#endif
+}
+
+static int RealPthreadCreate(pthread_t* thread, const pthread_attr_t* attr,
+                             void* (*start)(void*), void* arg) {
+  if (!real_pthread_create) {
+    real_pthread_create =
+        reinterpret_cast<PthreadCreate>(dlsym(RTLD_NEXT, "pthread_create"));
+  }
+
+  return real_pthread_create(thread, attr, start, arg);
+}
+
+#endif
+
+// Set while the reserve is being released on this thread, the
+// handler may allocate and a failure there must not recurse
+static thread_local bool releasing = false;
+
+static bool Release() {
+  if (releasing) {
+    return false;
+  }
+
+  releasing = true;
+
+  bool released = simple::NewHandler::ReleaseReserve();
+
+  releasing = false;
+
+  return released;
+}
+
+// Sizes glibc rejects without trying
+static bool Possible(size_t size) { return size <= PTRDIFF_MAX; }
+
+SHIM_EXPORT void* SHIM(malloc)(size_t size) {
+  void* ptr = RealMalloc(size);
+
+  while (!ptr && Possible(size) && Release()) {
+    ptr = RealMalloc(size);
+  }
+
+  return ptr;
+}
+
+SHIM_EXPORT void* SHIM(calloc)(size_t count, size_t size) {
+  void* ptr = RealCalloc(count, size);
+
+  if (count && size > PTRDIFF_MAX / count) {
+    // Overflow
+    return ptr;
+  }
+
+  while (!ptr && Release()) {
+    ptr = RealCalloc(count, size);
+  }
+
+  return ptr;
+}
+
+SHIM_EXPORT void* SHIM(realloc)(void* old, size_t size) {
+  void* ptr = RealRealloc(old, size);
+
+  // Zero size frees the old block
+  while (!ptr && size && Possible(size) && Release()) {
+    ptr = RealRealloc(old, size);
+  }
+
+  return ptr;
+}
+
+SHIM_EXPORT void* SHIM(memalign)(size_t alignment, size_t size) {
+  void* ptr = RealMemalign(alignment, size);
+
+  while (!ptr && errno == ENOMEM && Possible(size) && Release()) {
+    ptr = RealMemalign(alignment, size);
+  }
+
+  return ptr;
+}
+
+SHIM_EXPORT void* SHIM(aligned_alloc)(size_t alignment, size_t size) {
+  return SHIM(memalign)(alignment, size);
+}
+
+SHIM_EXPORT int SHIM(posix_memalign)(void** ptr, size_t alignment,
+                                     size_t size) {
+  if (alignment % sizeof(void*) != 0 ||
+      (alignment & (alignment - 1)) != 0 || alignment == 0) {
+    return EINVAL;
+  }
+
+  int saved = errno;
+  void* res = SHIM(memalign)(alignment, size);
+
+  errno = saved;
+
+  if (!res) {
+    return ENOMEM;
+  }
+
+  *ptr = res;
+  return 0;
+}
+
+SHIM_EXPORT void* SHIM(mmap)(void* addr, size_t len, int prot, int flags,
+                             int fd, off_t offset) {
+  void* ptr = RealMmap(addr, len, prot, flags, fd, offset);
+
+  while (ptr == MAP_FAILED && errno == ENOMEM && Release()) {
+    ptr = RealMmap(addr, len, prot, flags, fd, offset);
+  }
+
+  return ptr;
+}
+
+#ifndef SIMPLE_NEW_HANDLER_SHIM_WRAP
+// Same entry point with 64-bit offsets
+SHIM_EXPORT void* mmap64(void* addr, size_t len, int prot, int flags, int fd,
+                         off_t offset) {
+  return mmap(addr, len, prot, flags, fd, offset);
+}
+#endif
+
+// pthread_create() fails with EAGAIN on thread count limits too, so
+// check that a mapping of the stack size fails. glibc maps stacks with
+// its internal mmap(), the wrapper above does not see it.
+static bool StackFailed(const pthread_attr_t* attr) {
+  size_t size = 0;
+  void* stack = nullptr;
+  pthread_attr_t dflt;
+
+  if (attr) {
+    pthread_attr_getstack(attr, &stack, &size);
+  } else if (pthread_getattr_default_np(&dflt) == 0) {
+    pthread_attr_getstacksize(&dflt, &size);
+    pthread_attr_destroy(&dflt);
+  }
+
+  if (stack) {
+    // Caller provided stack
+    return false;
+  }
+
+  if (!size) {
+    size = 8 * 1024 * 1024;
+  }
+
+  int saved = errno;
+  void* ptr = RealMmap(nullptr, size, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  bool failed = ptr == MAP_FAILED;
+
+  if (!failed) {
+    munmap(ptr, size);
+  }
+
+  errno = saved;
+
+  return failed;
+}
+
+SHIM_EXPORT int SHIM(pthread_create)(pthread_t* thread,
+                                     const pthread_attr_t* attr,
+                                     void* (*start)(void*), void* arg) {
+  int res = RealPthreadCreate(thread, attr, start, arg);
+
+  // Retry once on a stack allocation failure
+  if (res == EAGAIN && StackFailed(attr) && Release()) {
+    res = RealPthreadCreate(thread, attr, start, arg);
+  }
+
+  return res;
+}
+
+#ifndef SIMPLE_NEW_HANDLER_SHIM_WRAP
+// Resolve the real pthread_create() and build the reserve requested
+// through the environment while memory is available
+__attribute__((constructor)) static void ShimInit() {
+  real_pthread_create =
+      reinterpret_cast<PthreadCreate>(dlsym(RTLD_NEXT, "pthread_create"));
+
+  const char* count = getenv("SIMPLE_NEW_HANDLER_RESERVE_COUNT");
+  const char* size = getenv("SIMPLE_NEW_HANDLER_RESERVE_SIZE");
+
+  if (count && size) {
+    simple::NewHandler::Init(0, strtoul(count, nullptr, 0),
+                             strtoul(size, nullptr, 0));
+  }
+}
+#endif
@@ -25,23 +25,120 @@
 #ifndef INCLUDE_SIMPLE_NEW_HANDLER_H_
 #define INCLUDE_SIMPLE_NEW_HANDLER_H_
 
+#include <atomic>
 #include <csignal>
 #include <cstdint>
 #include <cstdlib>
+#include <cstdio>
 #include <cstring>
 #include <exception>
 #include <limits>
+#include <mutex>
 #include <new>
+#include <thread>
 #include <utility>
 
 #if __cplusplus < 201703L
 #error "At least c++17 is required"
 #endif
 
+#include <chrono>
+#include <cmath>
+#include <ctime>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#define SIMPLE_NEW_HANDLER_NUMA 1
+#endif
+
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define SIMPLE_NEW_HANDLER_BACKTRACE 1
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#define SIMPLE_NEW_HANDLER_POSIX 1
+#endif
+
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+// Process-wide rendezvous of all copies of the handler
+//
+// Every shared object including this header defines the slot, the
+// first definition in the global lookup scope wins and points to the
+// registry of the copy that owns the reserve.
+//
+extern "C" {
+__attribute__((weak, visibility("default"))) void* simple_new_handler_registry =
+    nullptr;
+}
+#endif
+
 namespace simple {
 
+class ReserveLease;
+
 class NewHandler {
  public:
+  // Where reserved blocks come from
+  //
+  // kHeap - blocks are allocated with new[], under glibc they are
+  //         served by the arena of the thread that called Init()
+  //         and a released block may not be reusable by the arena
+  //         of the failing thread
+  //
+  // kMmap - blocks are anonymous mappings, a released block is
+  //         unmapped and returned to the system, so any arena of
+  //         any thread may reuse the memory
+  //
+  enum class ReserveMode { kHeap, kMmap };
+
+  // Select reserve mode, must be called before Init()
+  //
+  // kMmap falls back to kHeap where mmap() is not available. No effect
+  // once Init() is done in this copy or another copy owns the reserve.
+  //
+  static void SetReserveMode(ReserveMode mode) noexcept;
+
+  // Release reserved blocks in steps of at least 'step' bytes
+  //
+  // Only in kMmap mode: the tail of the first block is unmapped one
+  // step at a time, with the replacement operators the step also
+  // covers the failed request. The block counts as available until
+  // it is consumed completely. Zero (the default) disables it. Applies
+  // to the reserve of the copy that owns it. Call it after
+  // SetReserveMode(kMmap), returns false if the reserve is not in
+  // kMmap mode and the step is ignored.
+  //
+  static bool SetPartialRelease(size_t step) noexcept;
+
+  // Spread the reserve over NUMA nodes, must be called before Init()
+  //
+  // Nodes and their CPUs are discovered under 'sysfs_root', by default
+  // /sys/devices/system/node. Blocks are bound to nodes round-robin
+  // with mbind(), the handler releases a block local to the CPU of
+  // the failing thread first. Implies kMmap mode, Linux only. No
+  // effect once another copy owns the reserve.
+  //
+  static void SetNumaReserve(const char* sysfs_root = nullptr) noexcept;
+
+  static constexpr unsigned int kMaxNumaNodes = 16;
+  static constexpr unsigned int kMaxNumaCpus = 1024;
+
   // Initialize the driver and allocate reserved memory blocks
   //
   // If not enough memory allocate as many blocks as possible
@@ -59,7 +156,321 @@ class NewHandler {
     size_t available_block_count;
   };
 
-  static State GetState() noexcept { return full_state_.GetState(); }
+  // Called from the background thread when the reserve is built
+  using InitDoneCallback = void (*)(State state, void* context);
+
+  // Initialize the driver in the background
+  //
+  // The new-handler and the final block are set up right away, the
+  // reserve is built on a background thread. Blocks become available
+  // as they are allocated, FullState.reserve_pending is set until the
+  // reserve is complete, then 'done' is called. Returns false if the
+  // thread could not be started, the reserve is built before return.
+  // If it is done or another copy owns the reserve, 'done' is called
+  // right away with the state of that reserve.
+  //
+  static bool InitAsync(size_t final_block_size, size_t reserved_block_count,
+                        size_t reserved_block_size, int signo = 0,
+                        bool allow_chain = false,
+                        InitDoneCallback done = nullptr,
+                        void* context = nullptr) noexcept;
+
+  // Keep the last 'watermark' reserved blocks for critical threads
+  //
+  // Once available blocks drop to the watermark a best-effort thread
+  // gets std::bad_alloc from its failed allocation, while a thread
+  // inside CriticalScope keeps consuming reserved blocks.
+  // Zero (the default) disables admission control.
+  //
+  static void SetCriticalWatermark(size_t watermark) noexcept;
+
+  // Write an OOM report to 'fd' before terminate() or the chained
+  // handler is called, negative value (the default) disables it
+  //
+  static void SetReportFd(int fd) noexcept;
+
+  // Write the report: full state, per-class counters, times of
+  // recent block releases and /proc/self/statm
+  //
+  // It does not allocate memory, uses only a preallocated buffer
+  // and write(), and it is async-signal-safe.
+  //
+  static void WriteReport(int fd) noexcept;
+
+  // Journal events
+  //
+  enum class JournalEvent : uint32_t {
+    kInit = 1,         // reserve built, value: block size
+    kRelease,          // block released, value: bytes, arg: node
+    kPartialRelease,   // block tail released, value: bytes, arg: node
+    kRevoke,           // lent block revoked, value: bytes, arg: node
+    kReject,           // best-effort allocation rejected
+    kExhausted,        // reserve is empty, terminate or chain
+    kDrill,            // pressure drill, value: latency ns, arg: level
+    kExhaustionAlert,  // value: estimate in seconds
+    kDomainPressure,   // value: domain bytes, arg: domain
+    kSnapshot,         // value: usage bytes, extra: estimate in seconds,
+                       // arg: lent blocks
+    kTrim,             // allocator caches trimmed before a release
+    kDrain,            // drain hook started, value: deadline ms
+    kDrainTimeout,     // drain deadline passed, value: deadline ms
+  };
+
+  // Journal file layout: the header followed by the ring of records
+  //
+  struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint64_t pid;
+    uint64_t start_time_ns;
+    uint64_t reserved_block_size;
+    uint64_t reserved_block_count;
+    uint64_t unused;
+  };
+
+  // A record is valid when 'seq' is not zero, it is stored last
+  //
+  struct JournalRecord {
+    uint64_t seq;
+    uint64_t time_ns;
+    uint32_t event;
+    uint32_t arg;
+    uint64_t available;
+    uint64_t allocated;
+    uint64_t value;
+    uint64_t extra;
+    uint64_t unused;
+  };
+
+  static constexpr char kJournalMagic[8] = "SNHJRNL";
+  static constexpr uint32_t kJournalVersion = 1;
+
+  // Mirror handler events into a file-backed ring of 'record_count'
+  // records, returns false if the journal could not be set up
+  //
+  // The file at 'path', e.g. under /var/tmp, is created or truncated
+  // and mapped shared. Records are written with plain stores, no
+  // system calls, and the page cache keeps them when the process is
+  // killed. Expected to be called once before Init().
+  // See tools/journal_decode.
+  //
+  static bool SetJournal(const char* path,
+                         size_t record_count = 4096) noexcept;
+
+  // Append a snapshot of the full state to the journal, SampleUsage()
+  // appends one with every sample
+  //
+  static void JournalSnapshot() noexcept;
+
+  // Called by the handler before a lent block is reclaimed, neither
+  // the block nor any data in it may be used after it returns
+  //
+  using RevokeCallback = void (*)(void* context, void* data, size_t size);
+
+  // Lend an idle reserved block to the application as a discardable
+  // cache, returns false if there is no idle block
+  //
+  // Lent blocks still count as available. The handler releases idle
+  // blocks first and then revokes lent ones, calling 'revoke' before
+  // the memory is freed. The callback is invoked from the new-handler
+  // of the failing thread and must not allocate memory or lend blocks.
+  //
+  static bool LendBlock(ReserveLease* lease, RevokeCallback revoke,
+                        void* context) noexcept;
+
+  // Configure time-to-exhaustion estimator
+  //
+  // Usage samples are read from /proc/self/statm, 'statm_path'
+  // overrides it. The growth rate is fitted over recent samples
+  // against 'limit' bytes, zero means RLIMIT_AS. Virtual size is
+  // used unless 'use_rss' is set. When the estimate drops below
+  // 'threshold_sec' the configured signal is raised once, it is
+  // raised again only after the estimate gets back above it.
+  //
+  static void SetExhaustionEstimator(uint64_t threshold_sec, size_t limit = 0,
+                                     bool use_rss = false,
+                                     const char* statm_path = nullptr) noexcept;
+
+  // Take a usage sample, expected to be called at low frequency,
+  // e.g. once a minute from the application timer
+  //
+  static void SampleUsage() noexcept;
+
+  // Same with explicit sample time in milliseconds
+  static void SampleUsage(uint64_t now_ms) noexcept;
+
+  static constexpr uint64_t kNoEstimate = std::numeric_limits<uint64_t>::max();
+
+  // Budget domains
+  //
+  // Allocations are charged to the domain of the current thread, see
+  // DomainScope, domain 0 gets untagged allocations. Accounting needs
+  // the replacement operators enabled by defining
+  // SIMPLE_NEW_HANDLER_DEFINE_OPERATORS in exactly one source file
+  // before including this header. Nothing is charged until the first
+  // SetDomain() call, counters are sharded by thread.
+  //
+  static constexpr unsigned int kMaxDomains = 16;
+
+  // Called when the domain is the furthest over its soft cap
+  // at the moment a reserved block is released
+  //
+  using PressureCallback = void (*)(unsigned int domain, void* context);
+
+  // Configure a domain, a zero soft cap means no cap
+  //
+  static bool SetDomain(unsigned int domain, const char* name,
+                        size_t soft_cap, PressureCallback callback = nullptr,
+                        void* context = nullptr) noexcept;
+
+  // Pressure drill
+  //
+  // Run the notification path of 'level' block releases: raise the
+  // configured signal and notify domains, without touching the
+  // reserve. Returns time the notification path took in nanoseconds.
+  // FullState.drill_active is set while the drill runs. Domain
+  // callbacks run, but domain pressure is not counted or journaled.
+  //
+  static uint64_t SimulatePressure(size_t level = 1) noexcept;
+
+  // Report that the application finished shedding memory after
+  // a notification, real or simulated, FullState gets the latency
+  //
+  static void AckPressure() noexcept;
+
+  // Trim the allocator before releasing a reserved block
+  //
+  // On a failed allocation the handler first returns free memory
+  // cached by the allocator: malloc_trim() under glibc, purge of all
+  // arenas under jemalloc or MallocExtension_ReleaseFreeMemory() under
+  // tcmalloc when their symbols are found, and lets the allocation be
+  // retried. A failure of the same thread within 'retry_window_ms'
+  // after a trim releases a block. Zero (the default) disables it.
+  // FullState counts failures resolved by trimming alone only with
+  // the replacement operators.
+  //
+  static void SetTrim(uint64_t retry_window_ms) noexcept;
+
+  // Allocation trace: a header followed by records of allocation
+  // sizes, negative for frees, with monotonic time in nanoseconds
+  //
+  struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+  };
+
+  struct TraceRecord {
+    uint64_t time_ns;
+    int64_t size;
+  };
+
+  static constexpr char kTraceMagic[8] = "SNHTRCE";
+  static constexpr uint32_t kTraceVersion = 1;
+  static constexpr size_t kTraceRecords = 4096;
+
+  // Record allocations made by the replacement operators to 'fd',
+  // negative value (the default) disables it
+  //
+  // Records are collected in a preallocated buffer under a lock and
+  // written in batches when it is full, at FlushTrace() and before
+  // terminate() or the chained handler is called. Meant for tuning
+  // runs, see tools/reserve_sim.
+  //
+  static void SetTrace(int fd) noexcept;
+
+  // Write buffered trace records
+  static void FlushTrace() noexcept;
+
+  // Sampled heap profile
+  //
+  // Needs the replacement operators. On average one allocation per
+  // 'sample_bytes' allocated bytes is sampled: its stack is hashed
+  // into a fixed table that keeps estimated live bytes and count of
+  // live samples per stack, a sampled allocation leaves the table
+  // when it is freed. Top 'top' stacks are written to 'fd' with every
+  // block release, negative 'fd' disables the dump. Can be enabled
+  // only once, returns false if stacks are not supported.
+  //
+  static bool SetHeapProfile(size_t sample_bytes, int fd = -1,
+                             size_t top = 8) noexcept;
+
+  // Write top stacks of the heap profile, allocation-free
+  static void WriteHeapProfile(int fd) noexcept;
+
+  static constexpr size_t kProfileSlots = 512;
+  static constexpr size_t kProfileDepth = 16;
+  static constexpr size_t kProfileTop = 32;
+
+  // Release a reserved block, or a step of it, on a failure outside
+  // of operator new, e.g. in malloc() or mmap() wrappers, see shim/
+  //
+  // Same trim, admission, notifications and accounting as the
+  // new-handler, but it never throws or terminates: returns false if
+  // nothing was released and the caller should fail. A rejection is
+  // not counted here, the new-handler counts it if the caller is
+  // operator new.
+  //
+  static bool ReleaseReserve() noexcept;
+
+  // Called when the coordinator asks the process to shed memory
+  using ShedCallback = void (*)(void* context);
+
+  // Connect to a local coordinator over the Unix domain socket at
+  // 'path', see tools/coordinator
+  //
+  // The process registers with its 'priority' at Init(), or right
+  // away if it is done, and reports its state on every block release.
+  // A listener thread runs SHED commands by calling 'shed' and RELEASE
+  // commands by releasing a reserved block, so the coordinator can
+  // make less important workers give up memory too. The failing
+  // process does not wait for the coordinator, it has released its own
+  // block by the time a peer is asked: this is extra shedding, not an
+  // ordering of releases, and drains two blocks per failure. RELEASE keeps
+  // the blocks below the critical watermark for critical threads, a
+  // refused one is not counted as a best-effort rejection. Returns
+  // false if the connection or the thread failed.
+  //
+  // Protocol, one line per message:
+  //   to the coordinator: <verb> <pid> <priority> <allocated> <available>
+  //     verb: REGISTER, PRESSURE - released on a failure, RELEASED - on
+  //     a RELEASE command, EXHAUSTED - the reserve is empty
+  //   to the process: SHED or RELEASE
+  //
+  static bool ConnectCoordinator(const char* path, unsigned int priority,
+                                 ShedCallback shed = nullptr,
+                                 void* context = nullptr) noexcept;
+
+  // Called once when the reserve is empty, must not throw
+  using DrainHook = void (*)(void* context);
+
+  // Drain the process before it terminates
+  //
+  // When the reserve is empty the final block is released and the
+  // failing thread runs 'hook' as critical: stop accepting, flush,
+  // hand off connections. Allocations of other threads fail with
+  // std::bad_alloc meanwhile, an allocation failure of the hook itself
+  // terminates right away. A watchdog thread started here terminates
+  // the process if the hook runs longer than 'deadline_ms', zero
+  // disables the deadline. After the hook the chained handler or
+  // std::terminate() is called as usual. The watchdog waits on a pipe
+  // and does not hold the process at a normal exit. Can be set only
+  // once, returns false if it is set or the watchdog failed to start,
+  // a deadline needs POSIX.
+  //
+  static bool SetDrainHook(DrainHook hook, uint64_t deadline_ms,
+                           void* context = nullptr) noexcept;
+
+  // Allocation entry points for the replacement operators
+  //
+  static void* Allocate(size_t size, bool nothrow);
+  static void Deallocate(void* ptr) noexcept;
+
+  // Basic state
+  //
+  static State GetState() noexcept;
 
   // Full state
   //
@@ -71,6 +482,53 @@ class NewHandler {
           final_block_allocated(),
           reserved_block_size(),
           reserved_block_count(),
+          reserve_mode(ReserveMode::kHeap),
+          critical_watermark(),
+          critical_released_block_count(),
+          best_effort_released_block_count(),
+          best_effort_rejected_count(),
+          report_fd(-1),
+          lent_block_count(),
+          revoked_block_count(),
+          usage_limit(),
+          usage_bytes(),
+          exhaustion_estimate_sec(kNoEstimate),
+          exhaustion_alert_count(),
+          pressure_domain(-1),
+          domains(),
+          drill_active(),
+          drill_count(),
+          drill_latency_ns(),
+          reaction_latency_ns(),
+          reserve_pending(),
+          partial_release_step(),
+          partial_block_count(),
+          partial_release_count(),
+          partial_release_bytes(),
+          critical_partial_release_bytes(),
+          best_effort_partial_release_bytes(),
+          numa_node_count(),
+          numa_available(),
+          numa_local_release_count(),
+          numa_remote_release_count(),
+          numa_bind_error_count(),
+          journal_capacity(),
+          heap_profile_period(),
+          heap_profile_sample_count(),
+          heap_profile_dropped_count(),
+          heap_profile_dump_count(),
+          trim_window_ms(),
+          trim_count(),
+          trim_resolved_count(),
+          trace_record_count(),
+          coordinator_connected(),
+          coordinator_priority(),
+          coordinator_shed_count(),
+          coordinator_release_count(),
+          drain_deadline_ms(),
+          draining(),
+          drain_timed_out(),
+          drain_ns(),
           state() {}
     State GetState() const noexcept { return state; }
     bool init_done;
@@ -80,139 +538,2791 @@ class NewHandler {
     bool final_block_allocated;
     size_t reserved_block_size;
     size_t reserved_block_count;
+    ReserveMode reserve_mode;
+    size_t critical_watermark;
+    size_t critical_released_block_count;
+    size_t best_effort_released_block_count;
+    size_t best_effort_rejected_count;
+    int report_fd;
+    size_t lent_block_count;
+    size_t revoked_block_count;
+    size_t usage_limit;
+    size_t usage_bytes;
+    uint64_t exhaustion_estimate_sec;
+    size_t exhaustion_alert_count;
+    int pressure_domain;
+
+    struct Domain {
+      const char* name;
+      size_t bytes;
+      size_t soft_cap;
+      size_t pressure_count;
+    };
+
+    Domain domains[kMaxDomains];
+    bool drill_active;
+    size_t drill_count;
+    uint64_t drill_latency_ns;
+    uint64_t reaction_latency_ns;
+    bool reserve_pending;
+    size_t partial_release_step;
+    size_t partial_block_count;
+    size_t partial_release_count;
+    size_t partial_release_bytes;
+    size_t critical_partial_release_bytes;
+    size_t best_effort_partial_release_bytes;
+    unsigned int numa_node_count;
+    size_t numa_available[kMaxNumaNodes];
+    size_t numa_local_release_count;
+    size_t numa_remote_release_count;
+    size_t numa_bind_error_count;
+    size_t journal_capacity;
+    size_t heap_profile_period;
+    size_t heap_profile_sample_count;
+    size_t heap_profile_dropped_count;
+    size_t heap_profile_dump_count;
+    uint64_t trim_window_ms;
+    size_t trim_count;
+    size_t trim_resolved_count;
+    size_t trace_record_count;
+    bool coordinator_connected;
+    unsigned int coordinator_priority;
+    size_t coordinator_shed_count;
+    size_t coordinator_release_count;
+    uint64_t drain_deadline_ms;
+    bool draining;
+    bool drain_timed_out;
+    uint64_t drain_ns;
     State state;
   };
 
-  static FullState GetFullState() noexcept { return full_state_; }
+  static FullState GetFullState() noexcept;
 
  private:
+  friend class CriticalScope;
+  friend class ReserveLease;
+  friend class DomainScope;
+
   // The new-driver entry function
-  static void Process() noexcept;
+  //
+  // Throws std::bad_alloc to fail a best-effort allocation
+  //
+  static void Process();
 
+  // Admission control, false if a best-effort thread is rejected
+  static bool Admit(bool critical) noexcept;
+
+  // True if the rest of the reserve belongs to critical threads
+  static bool Rejects(bool critical) noexcept;
+
+  // Trim before a release, true if the allocation should be retried
+  static bool TrimFirst() noexcept;
+
+  // Release a block or its tail, false if the reserve is empty
+  static bool ReleaseBlock(bool critical) noexcept;
+
+  // Power of two size keeps blocks of usual sizes exact
   struct Blk {
     Blk* m_next;
+    size_t m_size;
+    size_t m_node;
+    size_t m_unused;
+  };
+
+  // Init() steps: record configuration and allocate the final
+  // block, build the reserve, install the new-handler
+  static bool Setup(size_t final_block_size, size_t reserved_block_count,
+                    size_t reserved_block_size, int signo) noexcept;
+  static void BuildReserve() noexcept;
+  static void Install(bool allow_chain) noexcept;
+
+  // Allocate and free a reserved block in the configured mode
+  static Blk* AllocBlock() noexcept;
+  static void FreeBlock(Blk* blk_arr, size_t size) noexcept;
+
+  // Size of a reserved block, whole pages in kMmap mode
+  static size_t BlockBytes() noexcept;
+
+  static size_t PageSize() noexcept;
+
+  // NUMA topology discovery, node binding and node of current CPU
+  static void DiscoverNuma() noexcept;
+  static void BindBlock(Blk* blk_arr, unsigned int node) noexcept;
+  static int LocalNode() noexcept;
+
+  // Report formatting into a preallocated buffer
+  struct ReportBuffer;
+
+  static void ReportText(ReportBuffer& out, const char* text) noexcept;
+  static void ReportNumber(ReportBuffer& out, uint64_t value) noexcept;
+  static void ReportField(ReportBuffer& out, const char* name,
+                          uint64_t value) noexcept;
+  static void ReportFlush(ReportBuffer& out, int fd) noexcept;
+
+  // Guards block lists, they are changed outside of the new-handler
+  // by lending, the lock is never held while memory is allocated
+  //
+  class ListLock {
+   public:
+    ListLock() noexcept {
+      while (list_lock_.test_and_set(std::memory_order_acquire)) {
+      }
+    }
+    ~ListLock() { list_lock_.clear(std::memory_order_release); }
+
+    ListLock(const ListLock&) = delete;
+    ListLock& operator=(const ListLock&) = delete;
+  };
+
+  // Return a lent block back to the idle list
+  static void ReturnBlock(ReserveLease* lease) noexcept;
+
+  // Prefix of every allocation made by the replacement operators
+  //
+  // Domain counters of a group of threads, on their own cache lines.
+  // A block freed by another thread is subtracted from that thread's
+  // shard, only the sum over shards is meaningful.
+  //
+  static constexpr unsigned int kDomainShards = 16;
+  static constexpr unsigned int kUncharged = kMaxDomains;
+
+  struct alignas(64) DomainShard {
+    std::atomic<size_t> bytes[kMaxDomains];
+  };
+
+  // Counter of 'domain' in the shard of the current thread
+  static std::atomic<size_t>& DomainBytes(unsigned int domain) noexcept;
+
+  // Bytes charged to 'domain' over all shards
+  static size_t DomainTotal(unsigned int domain) noexcept;
+
+  struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) AllocHdr {
+    size_t size;
+    unsigned int domain;  // kUncharged if not accounted
+    unsigned int sample;  // profile slot + 1, zero if not sampled
+  };
+
+  // Live samples of one stack
+  struct ProfileSlot {
+    std::atomic<uint64_t> hash;
+    std::atomic<size_t> depth;
+    std::atomic<size_t> bytes;
+    std::atomic<size_t> count;
+    void* frames[kProfileDepth];
+  };
+
+  // Return memory cached by the allocator
+  static void Trim() noexcept;
+
+  // Append a trace record, flush the buffer when it is full
+  static void TraceAllocation(int64_t size) noexcept;
+
+  // Swap buffers and write buffered records after releasing 'lock'
+  // on the current buffer
+  static void WriteTrace(std::unique_lock<std::mutex>& lock) noexcept;
+
+  // Send state to the coordinator if connected
+  static void CoordinatorSend(const char* verb) noexcept;
+
+  // Coordinator listener thread and its commands
+  static void CoordinatorListen(int fd) noexcept;
+  static void CoordinatorCommand(const char* command) noexcept;
+
+  // Drop the connection, the socket is closed once senders are done
+  static void CoordinatorDisconnect() noexcept;
+
+  // Run the drain hook on the failing thread
+  static void Drain() noexcept;
+
+  // Start or stop the drain deadline
+  static void DrainSignal() noexcept;
+
+  // Terminate if the drain hook misses the deadline
+  static void DrainWatchdog() noexcept;
+
+  // Sample an allocation, slow path of Allocate()
+  static void SampleAllocation(AllocHdr* hdr) noexcept;
+
+  // Remove a sampled allocation from the profile
+  static void UnsampleAllocation(AllocHdr* hdr) noexcept;
+
+  // Take or drop a sample reference to a slot of 'hash', the last
+  // reference retires the slot so the table does not fill up
+  static bool AddSample(ProfileSlot& slot, uint64_t hash) noexcept;
+  static void DropSample(ProfileSlot& slot) noexcept;
+
+  // Slot hash of a retired slot, live hashes are odd
+  static constexpr uint64_t kProfileTombstone = 2;
+
+  // Slot count while the slot is being retired
+  static constexpr size_t kProfileRetiring = ~size_t(0);
+
+  // Estimated bytes an allocation of 'size' stands for
+  static size_t SampleWeight(size_t size) noexcept;
+
+  // Bytes to allocate before the next sample
+  static int64_t NextSampleInterval() noexcept;
+
+  // Notification path of a block release started at 'start_ns'
+  static void Notify(uint64_t start_ns) noexcept;
+
+  // Notify the domain furthest over its soft cap
+  static void NotifyDomains() noexcept;
+
+  // Monotonic time in nanoseconds
+  static uint64_t NowNs() noexcept;
+
+  // Append an event to the journal if configured
+  static void Journal(JournalEvent event, uint32_t arg, uint64_t value,
+                      uint64_t extra = 0) noexcept;
+
+  // Thread state of scopes
+  static void EnterCritical() noexcept;
+  static void LeaveCritical() noexcept;
+  static unsigned int EnterDomain(unsigned int domain) noexcept;
+  static void LeaveDomain(unsigned int prev) noexcept;
+
+  // Entry points of the copy that owns the reserve
+  //
+  // Shared objects built with hidden visibility or -Bsymbolic get
+  // their own copies of the static members. The first copy to call
+  // Init() publishes its registry, the others forward to it.
+  //
+  struct Registry {
+    uint32_t version;
+    uint32_t size;
+    uint32_t full_state_size;
+    uint32_t lease_size;
+    State (*get_state)() noexcept;
+    FullState (*get_full_state)() noexcept;
+    void (*set_critical_watermark)(size_t) noexcept;
+    void (*set_report_fd)(int) noexcept;
+    void (*write_report)(int) noexcept;
+    bool (*lend_block)(ReserveLease*, RevokeCallback, void*) noexcept;
+    void (*return_block)(ReserveLease*) noexcept;
+    void (*set_exhaustion_estimator)(uint64_t, size_t, bool,
+                                     const char*) noexcept;
+    void (*sample_usage)(uint64_t) noexcept;
+    bool (*set_domain)(unsigned int, const char*, size_t, PressureCallback,
+                       void*) noexcept;
+    uint64_t (*simulate_pressure)(size_t) noexcept;
+    void (*ack_pressure)() noexcept;
+    void* (*allocate)(size_t, bool);
+    void (*deallocate)(void*) noexcept;
+    void (*enter_critical)() noexcept;
+    void (*leave_critical)() noexcept;
+    unsigned int (*enter_domain)(unsigned int) noexcept;
+    void (*leave_domain)(unsigned int) noexcept;
+    bool (*set_journal)(const char*, size_t) noexcept;
+    void (*journal_snapshot)() noexcept;
+    bool (*set_heap_profile)(size_t, int, size_t) noexcept;
+    void (*write_heap_profile)(int) noexcept;
+    void (*set_trim)(uint64_t) noexcept;
+    void (*set_trace)(int) noexcept;
+    void (*flush_trace)() noexcept;
+    bool (*release_reserve)() noexcept;
+    bool (*connect_coordinator)(const char*, unsigned int, ShedCallback,
+                                void*) noexcept;
+    bool (*set_drain_hook)(DrainHook, uint64_t, void*) noexcept;
+    bool (*set_partial_release)(size_t) noexcept;
+  };
+
+  static constexpr uint32_t kRegistryVersion = 10;
+
+  // Registry of another copy or null if this copy owns the reserve
+  static const Registry* Remote() noexcept;
+
+  // Publish own registry unless another copy did, false if it did
+  static bool Publish() noexcept;
+
+  // Read virtual or resident size from statm, zero on failure
+  static size_t ReadUsage() noexcept;
+
+  static constexpr size_t kReleaseHistory = 8;
+  static constexpr size_t kUsageSamples = 16;
+  static constexpr size_t kReportBufferSize = 4096;
+
+  struct ReportBuffer {
+    char data[kReportBufferSize];
+    size_t len;
   };
 
   static inline FullState full_state_;
   static inline unsigned int available_block_count_ = 0;
   static inline Blk* final_block_ = nullptr;
   static inline Blk* blk_arr_list_ = nullptr;
+  static inline ReserveLease* lent_list_ = nullptr;
+  static inline std::atomic_flag list_lock_ = ATOMIC_FLAG_INIT;
   static inline std::new_handler prev_handler_ = nullptr;
+  static inline size_t reserved_arr_size_ = 0;
+  static inline timespec release_times_[kReleaseHistory];
+  static inline size_t release_count_ = 0;
+  static inline uint64_t exhaustion_threshold_sec_ = 0;
+  static inline bool usage_use_rss_ = false;
+  static inline bool exhaustion_alerted_ = false;
+  static inline const char* statm_path_ = "/proc/self/statm";
+  static inline uint64_t usage_times_[kUsageSamples];
+  static inline size_t usage_samples_[kUsageSamples];
+  static inline size_t usage_sample_count_ = 0;
+  static inline ReportBuffer report_buf_;
+  static inline ReportBuffer profile_buf_;
+  static inline std::mutex profile_mutex_;
+  static inline unsigned int critical_watermark_ = 0;
+  static inline std::atomic<uint64_t> notify_time_ns_{0};
+  static inline JournalHeader* journal_header_ = nullptr;
+  static inline std::atomic<JournalRecord*> journal_records_{nullptr};
+  static inline std::atomic<uint64_t> journal_seq_{0};
+  static inline size_t profile_period_ = 0;
+  static inline int profile_fd_ = -1;
+  static inline size_t profile_top_ = 0;
+  static inline std::atomic<size_t> profile_samples_{0};
+  static inline std::atomic<size_t> profile_dropped_{0};
+  static inline ProfileSlot profile_slots_[kProfileSlots];
+  static inline thread_local int64_t sample_countdown_ = 0;
+  static inline thread_local uint64_t sample_rng_ = 0;
+  static inline thread_local bool sampling_ = false;
+  static inline uint64_t trim_window_ns_ = 0;
+  static inline int (*jemalloc_mallctl_)(const char*, void*, size_t*, void*,
+                                         size_t) = nullptr;
+  static inline void (*tcmalloc_release_)() = nullptr;
+  static inline thread_local bool trim_pending_ = false;
+  static inline thread_local uint64_t trim_deadline_ns_ = 0;
+  static inline int trace_fd_ = -1;
+  static inline thread_local bool untraced_ = false;
+  static inline std::atomic<int> coordinator_fd_{-1};
+  static inline std::atomic<int> coordinator_senders_{0};
+  static inline ShedCallback coordinator_shed_ = nullptr;
+  static inline void* coordinator_context_ = nullptr;
+  static inline thread_local bool coordinator_thread_ = false;
+  static inline DrainHook drain_hook_ = nullptr;
+  static inline void* drain_context_ = nullptr;
+  static inline std::atomic<bool> draining_{false};
+  static inline thread_local bool drainer_ = false;
+  static inline int drain_pipe_[2] = {-1, -1};
+  static inline TraceRecord trace_bufs_[2][kTraceRecords];
+  static inline unsigned int trace_cur_ = 0;
+  static inline size_t trace_len_ = 0;
+  static inline std::mutex trace_mutex_;
+  static inline std::mutex trace_write_mutex_;
+  static inline thread_local unsigned int critical_depth_ = 0;
+  static inline const char* numa_root_ = nullptr;
+  static inline unsigned char cpu_node_[kMaxNumaCpus];
+  static inline unsigned int numa_nodes_[kMaxNumaNodes];
+  static inline thread_local bool building_ = false;
+  static inline thread_local size_t request_size_ = 0;
+  static inline thread_local unsigned int current_domain_ = 0;
+  static inline DomainShard domain_shards_[kDomainShards];
+  static inline std::atomic<unsigned int> domain_shard_next_{0};
+  static inline thread_local unsigned int domain_shard_ = kDomainShards;
+  static inline std::atomic<bool> domains_used_{false};
+  static inline PressureCallback domain_callbacks_[kMaxDomains];
+  static inline void* domain_contexts_[kMaxDomains];
+  static inline std::atomic<void**> registry_slot_{nullptr};
+  static const Registry registry_;
 };
 
-inline void NewHandler::Init(size_t final_block_size,
-                             size_t reserved_block_count,
-                             size_t reserved_block_size, int signo,
-                             bool allow_chain) noexcept {
-  if (full_state_.init_done) {
-    // We expect to be done once and it is done
-    // more than once we do not care much
-    return;
-  }
-
-  full_state_.init_done = true;
-  full_state_.signo = signo;
-  full_state_.final_block_size = final_block_size;
-  full_state_.reserved_block_count = reserved_block_count;
-  full_state_.reserved_block_size = reserved_block_size;
+// Mark the current thread as critical for the scope lifetime
+//
+// Scopes nest, the thread stays critical until the outermost
+// one is destroyed.
+//
+class CriticalScope {
+ public:
+  CriticalScope() noexcept { NewHandler::EnterCritical(); }
+  ~CriticalScope() { NewHandler::LeaveCritical(); }
 
-  size_t finalSize =
-      (final_block_size + sizeof(Blk) - 1) / sizeof(Blk) * sizeof(Blk);
+  CriticalScope(const CriticalScope&) = delete;
+  CriticalScope& operator=(const CriticalScope&) = delete;
+};
 
-  if (finalSize) {
-    final_block_ = new (std::nothrow) Blk[finalSize / sizeof(Blk)];
+// Charge allocations of the current thread to a budget domain
+//
+// Scopes nest, the previous domain is restored on destruction.
+//
+class DomainScope {
+ public:
+  explicit DomainScope(unsigned int domain) noexcept
+      : prev_(NewHandler::EnterDomain(domain)) {}
+  ~DomainScope() { NewHandler::LeaveDomain(prev_); }
 
-    if (final_block_) {
-      full_state_.final_block_allocated = true;
+  DomainScope(const DomainScope&) = delete;
+  DomainScope& operator=(const DomainScope&) = delete;
 
-      // Assign a value to map allocated block
-      //
-      final_block_->m_next = 0;
-    }
-  }
+ private:
+  unsigned int prev_;
+};
 
-  unsigned int block_limit = std::numeric_limits<unsigned int>::max();
+// Reserved block lent to the application
+//
+// The lease is returned on destruction. It must outlive the lending
+// unless it is returned or revoked first.
+//
+class ReserveLease {
+ public:
+  ReserveLease() noexcept
+      : data_(nullptr),
+        size_(0),
+        node_(0),
+        revoke_(nullptr),
+        context_(nullptr),
+        next_(nullptr) {}
+  ~ReserveLease() { Return(); }
 
-  // We always allocate and immediately free extra block
-  // to support the strategy of managing all available
-  // memory through this mechanism
-  //
-  if ((reserved_block_count + 1) < block_limit)
-    block_limit = static_cast<unsigned int>(reserved_block_count + 1);
+  ReserveLease(const ReserveLease&) = delete;
+  ReserveLease& operator=(const ReserveLease&) = delete;
 
-  if (reserved_block_count && reserved_block_size) {
-    size_t reserved_arr_size =
-        (reserved_block_size + sizeof(Blk) - 1) / sizeof(Blk);
+  // Lent memory, null if not lent or already revoked
+  void* data() const noexcept { return data_; }
+  size_t size() const noexcept { return size_; }
 
-    // We have to count actually allocated blocks
-    size_t arr_count = 0;
+  // Give the block back to the reserve, no-op if not lent
+  void Return() noexcept { NewHandler::ReturnBlock(this); }
 
-    for (unsigned int ii = 0; ii < block_limit; ii++) {
-      Blk* blk_arr = new (std::nothrow) Blk[reserved_arr_size];
+ private:
+  friend class NewHandler;
 
-      if (!blk_arr) {
-        break;
-      }
+  void* data_;
+  size_t size_;
+  size_t node_;
+  NewHandler::RevokeCallback revoke_;
+  void* context_;
+  ReserveLease* next_;
+};
 
-      arr_count++;
+inline const NewHandler::Registry NewHandler::registry_ = {
+    kRegistryVersion,
+    sizeof(Registry),
+    sizeof(FullState),
+    sizeof(ReserveLease),
+    &NewHandler::GetState,
+    &NewHandler::GetFullState,
+    &NewHandler::SetCriticalWatermark,
+    &NewHandler::SetReportFd,
+    &NewHandler::WriteReport,
+    &NewHandler::LendBlock,
+    &NewHandler::ReturnBlock,
+    &NewHandler::SetExhaustionEstimator,
+    static_cast<void (*)(uint64_t) noexcept>(&NewHandler::SampleUsage),
+    &NewHandler::SetDomain,
+    &NewHandler::SimulatePressure,
+    &NewHandler::AckPressure,
+    &NewHandler::Allocate,
+    &NewHandler::Deallocate,
+    &NewHandler::EnterCritical,
+    &NewHandler::LeaveCritical,
+    &NewHandler::EnterDomain,
+    &NewHandler::LeaveDomain,
+    &NewHandler::SetJournal,
+    &NewHandler::JournalSnapshot,
+    &NewHandler::SetHeapProfile,
+    &NewHandler::WriteHeapProfile,
+    &NewHandler::SetTrim,
+    &NewHandler::SetTrace,
+    &NewHandler::FlushTrace,
+    &NewHandler::ReleaseReserve,
+    &NewHandler::ConnectCoordinator,
+    &NewHandler::SetDrainHook,
+    &NewHandler::SetPartialRelease,
+};
 
-      blk_arr[0].m_next = blk_arr_list_;
-      blk_arr_list_ = blk_arr;
-    }
+inline const NewHandler::Registry* NewHandler::Remote() noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  void** slot = registry_slot_.load(std::memory_order_acquire);
 
-    if (blk_arr_list_) {
-      // Immediately release the last block
-      //
-      Blk* blk_arr = blk_arr_list_;
-      blk_arr_list_ = blk_arr[0].m_next;
+  if (!slot) {
+    // Look up through the main program, RTLD_DEFAULT would honor
+    // -Bsymbolic of the caller and find the own slot first
+    void* program = dlopen(nullptr, RTLD_NOW);
 
-      delete[] blk_arr;
+    if (program) {
+      slot = static_cast<void**>(dlsym(program, "simple_new_handler_registry"));
+      dlclose(program);
+    }
 
-      full_state_.state.allocated_block_count = arr_count - 1;
-      full_state_.state.available_block_count = arr_count - 1;
-      available_block_count_ = arr_count - 1;
+    if (!slot) {
+      slot = &simple_new_handler_registry;
     }
-  }
 
-  if (!allow_chain) {
-    std::set_new_handler(NewHandler::Process);
-    return;
+    registry_slot_.store(slot, std::memory_order_release);
   }
 
-  prev_handler_ = std::set_new_handler(NewHandler::Process);
+  const Registry* registry =
+      static_cast<const Registry*>(__atomic_load_n(slot, __ATOMIC_ACQUIRE));
 
-  if (prev_handler_) {
-    full_state_.chained = true;
+  if (!registry || registry == &registry_) {
+    return nullptr;
   }
-}
-
-inline void NewHandler::Process() noexcept {
-  Blk* blk_arr = blk_arr_list_;
 
-  if (blk_arr) {
-    // Release the first avalable block to the process
-    // and raise signal if configured
-    blk_arr_list_ = blk_arr[0].m_next;
+  // Incompatible copy keeps its own reserve
+  if (registry->version != kRegistryVersion ||
+      registry->size != sizeof(Registry) ||
+      registry->full_state_size != sizeof(FullState) ||
+      registry->lease_size != sizeof(ReserveLease)) {
+    return nullptr;
+  }
 
-    delete[] blk_arr;
+  return registry;
+#else
+  return nullptr;
+#endif
+}
 
-    if (available_block_count_ > 0) {
-      available_block_count_--;
+inline bool NewHandler::Publish() noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  Remote();
 
-      // Note: we do not decrement this field in full_state
-      // to avoid issues with concurrent access to full state
-      full_state_.state.available_block_count = available_block_count_;
-    }
+  void** slot = registry_slot_.load(std::memory_order_acquire);
+  void* expected = nullptr;
+  void* own = const_cast<Registry*>(&registry_);
 
-    if (full_state_.signo != 0) std::raise(full_state_.signo);
+  // Copies may call Init() concurrently, only one wins the slot
+  return __atomic_compare_exchange_n(slot, &expected, own, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+         expected == own;
+#else
+  return true;
+#endif
+}
 
-    return;
+inline NewHandler::State NewHandler::GetState() noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->get_state();
   }
 
-  // Release final block and terminate or call chained handler
+  return full_state_.GetState();
+}
+
+inline void NewHandler::EnterCritical() noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->enter_critical();
+    return;
+  }
+
+  critical_depth_++;
+}
+
+inline void NewHandler::LeaveCritical() noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->leave_critical();
+    return;
+  }
+
+  critical_depth_--;
+}
+
+inline unsigned int NewHandler::EnterDomain(unsigned int domain) noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->enter_domain(domain);
+  }
+
+  unsigned int prev = current_domain_;
+
+  if (domain < kMaxDomains) {
+    current_domain_ = domain;
+  }
+
+  return prev;
+}
+
+inline void NewHandler::LeaveDomain(unsigned int prev) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->leave_domain(prev);
+    return;
+  }
+
+  current_domain_ = prev;
+}
+
+inline bool NewHandler::Setup(size_t final_block_size,
+                              size_t reserved_block_count,
+                              size_t reserved_block_size, int signo) noexcept {
+  if (full_state_.init_done || Remote()) {
+    // We expect to be done once and it is done
+    // more than once we do not care much
+    return false;
+  }
+
+  if (!Publish()) {
+    // Another copy won the race, it owns the reserve
+    return false;
+  }
+
+  full_state_.init_done = true;
+  full_state_.signo = signo;
+  full_state_.final_block_size = final_block_size;
+  full_state_.reserved_block_count = reserved_block_count;
+  full_state_.reserved_block_size = reserved_block_size;
+
+  size_t finalSize =
+      (final_block_size + sizeof(Blk) - 1) / sizeof(Blk) * sizeof(Blk);
+
+  if (finalSize) {
+    untraced_ = true;
+    final_block_ = new (std::nothrow) Blk[finalSize / sizeof(Blk)];
+    untraced_ = false;
+
+    if (final_block_) {
+      full_state_.final_block_allocated = true;
+
+      // Assign a value to map allocated block
+      //
+      final_block_->m_next = 0;
+    }
+  }
+
+  if (reserved_block_count && reserved_block_size) {
+    reserved_arr_size_ = (reserved_block_size + sizeof(Blk) - 1) / sizeof(Blk);
+  }
+
+  return true;
+}
+
+inline void NewHandler::BuildReserve() noexcept {
+  size_t reserved_block_count = full_state_.reserved_block_count;
+
+  if (!reserved_block_count || !reserved_arr_size_) {
+    return;
+  }
+
+  unsigned int block_limit = std::numeric_limits<unsigned int>::max();
+
+  // We always allocate and immediately free extra block
+  // to support the strategy of managing all available
+  // memory through this mechanism
+  //
+  if ((reserved_block_count + 1) < block_limit)
+    block_limit = static_cast<unsigned int>(reserved_block_count + 1);
+
+  unsigned int node_count = full_state_.numa_node_count;
+
+  // Every block but the last one goes to the list as soon as
+  // the next one is allocated, so the handler may use it
+  Blk* last_arr = nullptr;
+  unsigned int last_node = 0;
+
+  // Failures while building must not release blocks just built,
+  // in the new-handler or in ReleaseReserve() called by the shim
+  building_ = true;
+
+  for (unsigned int ii = 0; ii < block_limit; ii++) {
+    Blk* blk_arr = AllocBlock();
+
+    if (!blk_arr) {
+      break;
+    }
+
+    // Bind before the block is touched
+    unsigned int node = node_count ? ii % node_count : 0;
+
+    if (node_count) {
+      BindBlock(blk_arr, node);
+    }
+
+    if (last_arr) {
+      ListLock lock;
+
+      last_arr[0].m_next = blk_arr_list_;
+      last_arr[0].m_size = BlockBytes();
+      last_arr[0].m_node = last_node;
+      blk_arr_list_ = last_arr;
+
+      if (node_count) {
+        full_state_.numa_available[last_node]++;
+      }
+
+      available_block_count_++;
+      full_state_.state.allocated_block_count++;
+      full_state_.state.available_block_count = available_block_count_;
+    }
+
+    last_arr = blk_arr;
+    last_node = node;
+  }
+
+  if (last_arr) {
+    // Immediately release the last block
+    //
+    FreeBlock(last_arr, BlockBytes());
+  }
+
+  building_ = false;
+
+  if (journal_header_) {
+    journal_header_->reserved_block_size = BlockBytes();
+    journal_header_->reserved_block_count = reserved_block_count;
+  }
+
+  Journal(JournalEvent::kInit, 0, BlockBytes());
+  CoordinatorSend("REGISTER");
+}
+
+inline void NewHandler::Install(bool allow_chain) noexcept {
+  if (!allow_chain) {
+    std::set_new_handler(NewHandler::Process);
+    return;
+  }
+
+  prev_handler_ = std::set_new_handler(NewHandler::Process);
+
+  if (prev_handler_) {
+    full_state_.chained = true;
+  }
+}
+
+inline void NewHandler::Init(size_t final_block_size,
+                             size_t reserved_block_count,
+                             size_t reserved_block_size, int signo,
+                             bool allow_chain) noexcept {
+  if (!Setup(final_block_size, reserved_block_count, reserved_block_size,
+             signo)) {
+    return;
+  }
+
+  BuildReserve();
+  Install(allow_chain);
+}
+
+inline bool NewHandler::InitAsync(size_t final_block_size,
+                                  size_t reserved_block_count,
+                                  size_t reserved_block_size, int signo,
+                                  bool allow_chain, InitDoneCallback done,
+                                  void* context) noexcept {
+  if (!Setup(final_block_size, reserved_block_count, reserved_block_size,
+             signo)) {
+    if (done) {
+      done(GetState(), context);
+    }
+
+    return true;
+  }
+
+  Install(allow_chain);
+
+  full_state_.reserve_pending = true;
+
+  auto build = [done, context]() {
+    BuildReserve();
+
+    full_state_.reserve_pending = false;
+
+    if (done) {
+      done(GetState(), context);
+    }
+  };
+
+  try {
+    std::thread(build).detach();
+  } catch (...) {
+    // No thread, build it here
+    build();
+    return false;
+  }
+
+  return true;
+}
+
+inline void NewHandler::SetReserveMode(ReserveMode mode) noexcept {
+  if (full_state_.init_done || Remote()) {
+    // Blocks are already allocated
+    return;
+  }
+
+#ifndef SIMPLE_NEW_HANDLER_POSIX
+  mode = ReserveMode::kHeap;
+#endif
+
+  full_state_.reserve_mode = mode;
+}
+
+inline size_t NewHandler::PageSize() noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+  return page;
+#else
+  return 4096;
+#endif
+}
+
+inline size_t NewHandler::BlockBytes() noexcept {
+  size_t size = reserved_arr_size_ * sizeof(Blk);
+
+  if (full_state_.reserve_mode == ReserveMode::kMmap) {
+    size_t page = PageSize();
+
+    size = (size + page - 1) / page * page;
+  }
+
+  return size;
+}
+
+inline void NewHandler::SetNumaReserve(const char* sysfs_root) noexcept {
+#ifdef SIMPLE_NEW_HANDLER_NUMA
+  if (full_state_.init_done || Remote()) {
+    // Blocks are already allocated
+    return;
+  }
+
+  numa_root_ = sysfs_root ? sysfs_root : "/sys/devices/system/node";
+  full_state_.reserve_mode = ReserveMode::kMmap;
+
+  DiscoverNuma();
+#else
+  (void)sysfs_root;
+#endif
+}
+
+inline void NewHandler::DiscoverNuma() noexcept {
+#ifdef SIMPLE_NEW_HANDLER_NUMA
+  unsigned int count = 0;
+
+  for (unsigned int node = 0; node < kMaxNumaNodes; node++) {
+    // <root>/node<N>/cpulist, e.g. "0-3,8-11"
+    char path[256];
+    snprintf(path, sizeof(path), "%s/node%u/cpulist", numa_root_, node);
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+      continue;
+    }
+
+    char buf[512];
+    ssize_t res = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    buf[res > 0 ? res : 0] = 0;
+
+    for (char* ptr = buf; *ptr >= '0' && *ptr <= '9';) {
+      unsigned long first = strtoul(ptr, &ptr, 10);
+      unsigned long last = first;
+
+      if (*ptr == '-') {
+        last = strtoul(ptr + 1, &ptr, 10);
+      }
+
+      for (unsigned long cpu = first; cpu <= last && cpu < kMaxNumaCpus;
+           cpu++) {
+        cpu_node_[cpu] = static_cast<unsigned char>(count);
+      }
+
+      if (*ptr == ',') {
+        ptr++;
+      }
+    }
+
+    numa_nodes_[count++] = node;
+  }
+
+  full_state_.numa_node_count = count;
+#endif
+}
+
+inline void NewHandler::BindBlock(Blk* blk_arr, unsigned int node) noexcept {
+#ifdef SIMPLE_NEW_HANDLER_NUMA
+  // MPOL_BIND to a single node
+  const int kMpolBind = 2;
+  unsigned long mask[kMaxNumaNodes / (8 * sizeof(unsigned long)) + 1] = {};
+  unsigned int system_node = numa_nodes_[node];
+
+  mask[system_node / (8 * sizeof(unsigned long))] |=
+      1UL << (system_node % (8 * sizeof(unsigned long)));
+
+  if (syscall(SYS_mbind, blk_arr, BlockBytes(), kMpolBind, mask,
+              sizeof(mask) * 8, 0) != 0) {
+    full_state_.numa_bind_error_count++;
+  }
+#else
+  (void)blk_arr;
+  (void)node;
+#endif
+}
+
+inline int NewHandler::LocalNode() noexcept {
+#ifdef SIMPLE_NEW_HANDLER_NUMA
+  if (full_state_.numa_node_count == 0) {
+    return -1;
+  }
+
+  int cpu = sched_getcpu();
+
+  if (cpu < 0 || static_cast<unsigned int>(cpu) >= kMaxNumaCpus) {
+    return -1;
+  }
+
+  return cpu_node_[cpu];
+#else
+  return -1;
+#endif
+}
+
+inline bool NewHandler::SetPartialRelease(size_t step) noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->set_partial_release(step);
+  }
+
+  if (full_state_.reserve_mode != ReserveMode::kMmap) {
+    return false;
+  }
+
+  size_t page = PageSize();
+
+  full_state_.partial_release_step = (step + page - 1) / page * page;
+
+  return true;
+}
+
+inline NewHandler::Blk* NewHandler::AllocBlock() noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  if (full_state_.reserve_mode == ReserveMode::kMmap) {
+    void* addr = mmap(nullptr, BlockBytes(), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (addr == MAP_FAILED) {
+      return nullptr;
+    }
+
+    return static_cast<Blk*>(addr);
+  }
+#endif
+
+  untraced_ = true;
+  Blk* blk_arr = new (std::nothrow) Blk[reserved_arr_size_];
+  untraced_ = false;
+
+  return blk_arr;
+}
+
+inline void NewHandler::FreeBlock(Blk* blk_arr, size_t size) noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  if (full_state_.reserve_mode == ReserveMode::kMmap) {
+    munmap(blk_arr, size);
+    return;
+  }
+#endif
+
+  (void)size;
+
+  untraced_ = true;
+  delete[] blk_arr;
+  untraced_ = false;
+}
+
+inline void NewHandler::SetCriticalWatermark(size_t watermark) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->set_critical_watermark(watermark);
+    return;
+  }
+
+  unsigned int limit = std::numeric_limits<unsigned int>::max();
+
+  if (watermark < limit) limit = static_cast<unsigned int>(watermark);
+
+  full_state_.critical_watermark = watermark;
+  critical_watermark_ = limit;
+}
+
+inline bool NewHandler::LendBlock(ReserveLease* lease, RevokeCallback revoke,
+                                  void* context) noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->lend_block(lease, revoke, context);
+  }
+
+  if (lease->data_) {
+    // Already lent
+    return false;
+  }
+
+  ListLock lock;
+
+  Blk* blk_arr = blk_arr_list_;
+
+  if (!blk_arr) {
+    return false;
+  }
+
+  blk_arr_list_ = blk_arr[0].m_next;
+
+  lease->data_ = blk_arr;
+  lease->size_ = blk_arr[0].m_size;
+  lease->node_ = blk_arr[0].m_node;
+  lease->revoke_ = revoke;
+  lease->context_ = context;
+  lease->next_ = lent_list_;
+  lent_list_ = lease;
+
+  full_state_.lent_block_count++;
+
+  return true;
+}
+
+inline void NewHandler::ReturnBlock(ReserveLease* lease) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->return_block(lease);
+    return;
+  }
+
+  ListLock lock;
+
+  if (!lease->data_) {
+    // Not lent or revoked
+    return;
+  }
+
+  ReserveLease** link = &lent_list_;
+
+  while (*link != lease) {
+    link = &(*link)->next_;
+  }
+
+  *link = lease->next_;
+
+  Blk* blk_arr = static_cast<Blk*>(lease->data_);
+
+  blk_arr[0].m_next = blk_arr_list_;
+  blk_arr[0].m_size = lease->size_;
+  blk_arr[0].m_node = lease->node_;
+  blk_arr_list_ = blk_arr;
+
+  lease->data_ = nullptr;
+  lease->next_ = nullptr;
+
+  full_state_.lent_block_count--;
+}
+
+inline void NewHandler::SetExhaustionEstimator(
+    uint64_t threshold_sec, size_t limit, bool use_rss,
+    const char* statm_path) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->set_exhaustion_estimator(threshold_sec, limit, use_rss,
+                                     statm_path);
+    return;
+  }
+
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  if (limit == 0) {
+    rlimit rl;
+
+    if (getrlimit(RLIMIT_AS, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+      limit = static_cast<size_t>(rl.rlim_cur);
+    }
+  }
+#endif
+
+  if (statm_path) {
+    statm_path_ = statm_path;
+  }
+
+  exhaustion_threshold_sec_ = threshold_sec;
+  usage_use_rss_ = use_rss;
+  exhaustion_alerted_ = false;
+  usage_sample_count_ = 0;
+
+  full_state_.usage_limit = limit;
+  full_state_.exhaustion_estimate_sec = kNoEstimate;
+}
+
+inline size_t NewHandler::ReadUsage() noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  char buf[128];
+
+  int fd = open(statm_path_, O_RDONLY);
+
+  if (fd < 0) {
+    return 0;
+  }
+
+  ssize_t res = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+
+  if (res <= 0) {
+    return 0;
+  }
+
+  buf[res] = 0;
+
+  // Size and resident pages are the first two fields
+  char* end = nullptr;
+  size_t pages = strtoul(buf, &end, 10);
+
+  if (usage_use_rss_) {
+    pages = strtoul(end, nullptr, 10);
+  }
+
+  return pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+  return 0;
+#endif
+}
+
+inline void NewHandler::SampleUsage() noexcept {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+
+  SampleUsage(static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(now).count()));
+}
+
+inline void NewHandler::SampleUsage(uint64_t now_ms) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->sample_usage(now_ms);
+    return;
+  }
+
+  size_t usage = ReadUsage();
+  size_t limit = full_state_.usage_limit;
+
+  if (usage == 0 || limit == 0) {
+    return;
+  }
+
+  usage_times_[usage_sample_count_ % kUsageSamples] = now_ms;
+  usage_samples_[usage_sample_count_ % kUsageSamples] = usage;
+  usage_sample_count_++;
+
+  full_state_.usage_bytes = usage;
+
+  size_t count = usage_sample_count_ < kUsageSamples ? usage_sample_count_
+                                                     : kUsageSamples;
+
+  if (count < 2) {
+    return;
+  }
+
+  // Least squares fit of usage against time, relative to the oldest
+  // sample to keep precision
+  size_t first = usage_sample_count_ - count;
+  double t0 = static_cast<double>(usage_times_[first % kUsageSamples]);
+  double u0 = static_cast<double>(usage_samples_[first % kUsageSamples]);
+  double sum_t = 0, sum_u = 0, sum_tt = 0, sum_tu = 0;
+
+  for (size_t ii = first; ii < usage_sample_count_; ii++) {
+    double t = (static_cast<double>(usage_times_[ii % kUsageSamples]) - t0) /
+               1000.0;
+    double u = static_cast<double>(usage_samples_[ii % kUsageSamples]) - u0;
+
+    sum_t += t;
+    sum_u += u;
+    sum_tt += t * t;
+    sum_tu += t * u;
+  }
+
+  double n = static_cast<double>(count);
+  double denom = n * sum_tt - sum_t * sum_t;
+  uint64_t estimate = kNoEstimate;
+
+  if (usage >= limit) {
+    estimate = 0;
+  } else if (denom > 0) {
+    double rate = (n * sum_tu - sum_t * sum_u) / denom;
+
+    if (rate > 0) {
+      estimate =
+          static_cast<uint64_t>(static_cast<double>(limit - usage) / rate);
+    }
+  }
+
+  full_state_.exhaustion_estimate_sec = estimate;
+
+  JournalSnapshot();
+
+  if (estimate >= exhaustion_threshold_sec_) {
+    exhaustion_alerted_ = false;
+    return;
+  }
+
+  if (exhaustion_alerted_) {
+    return;
+  }
+
+  exhaustion_alerted_ = true;
+  full_state_.exhaustion_alert_count++;
+
+  Journal(JournalEvent::kExhaustionAlert, 0, estimate);
+
+  if (full_state_.signo != 0) std::raise(full_state_.signo);
+}
+
+inline NewHandler::FullState NewHandler::GetFullState() noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->get_full_state();
+  }
+
+  FullState state = full_state_;
+
+  for (unsigned int ii = 0; ii < kMaxDomains; ii++) {
+    state.domains[ii].bytes = DomainTotal(ii);
+  }
+
+  state.heap_profile_sample_count =
+      profile_samples_.load(std::memory_order_relaxed);
+  state.heap_profile_dropped_count =
+      profile_dropped_.load(std::memory_order_relaxed);
+
+  return state;
+}
+
+inline bool NewHandler::SetDomain(unsigned int domain, const char* name,
+                                  size_t soft_cap, PressureCallback callback,
+                                  void* context) noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->set_domain(domain, name, soft_cap, callback, context);
+  }
+
+  if (domain >= kMaxDomains) {
+    return false;
+  }
+
+  full_state_.domains[domain].name = name;
+  full_state_.domains[domain].soft_cap = soft_cap;
+  domain_callbacks_[domain] = callback;
+  domain_contexts_[domain] = context;
+
+  // Start charging allocations from now on
+  domains_used_.store(true, std::memory_order_relaxed);
+
+  return true;
+}
+
+inline std::atomic<size_t>& NewHandler::DomainBytes(
+    unsigned int domain) noexcept {
+  if (domain_shard_ == kDomainShards) {
+    domain_shard_ =
+        domain_shard_next_.fetch_add(1, std::memory_order_relaxed) %
+        kDomainShards;
+  }
+
+  return domain_shards_[domain_shard_].bytes[domain];
+}
+
+inline size_t NewHandler::DomainTotal(unsigned int domain) noexcept {
+  size_t total = 0;
+
+  for (unsigned int ii = 0; ii < kDomainShards; ii++) {
+    total += domain_shards_[ii].bytes[domain].load(std::memory_order_relaxed);
+  }
+
+  return total;
+}
+
+inline void* NewHandler::Allocate(size_t size, bool nothrow) {
+  if (const Registry* remote = Remote()) {
+    return remote->allocate(size, nothrow);
+  }
+
+  // Set when the handler only trimmed the allocator
+  bool trimmed = false;
+
+  // Same loop as the standard operator new
+  for (;;) {
+    void* ptr = nullptr;
+
+    if (size <= std::numeric_limits<size_t>::max() - sizeof(AllocHdr)) {
+      ptr = malloc(size + sizeof(AllocHdr));
+    }
+
+    if (ptr) {
+      AllocHdr* hdr = static_cast<AllocHdr*>(ptr);
+
+      hdr->size = size;
+      hdr->domain = kUncharged;
+      hdr->sample = 0;
+
+      if (domains_used_.load(std::memory_order_relaxed)) {
+        unsigned int domain = current_domain_;
+
+        hdr->domain = domain;
+        DomainBytes(domain).fetch_add(size, std::memory_order_relaxed);
+      }
+
+      if (profile_period_ != 0) {
+        sample_countdown_ -= static_cast<int64_t>(size);
+
+        if (sample_countdown_ < 0) {
+          SampleAllocation(hdr);
+        }
+      }
+
+      if (trimmed) {
+        // Trimming was enough, the next failure trims again
+        trim_pending_ = false;
+        full_state_.trim_resolved_count++;
+      }
+
+      if (trace_fd_ >= 0) {
+        TraceAllocation(static_cast<int64_t>(size));
+      }
+
+      return hdr + 1;
+    }
+
+    std::new_handler handler = std::get_new_handler();
+
+    // Let the handler know the size of the failed request
+    request_size_ = size + sizeof(AllocHdr);
+
+    if (!handler) {
+      if (nothrow) {
+        return nullptr;
+      }
+
+      throw std::bad_alloc();
+    }
+
+    if (!nothrow) {
+      handler();
+      trimmed = trim_pending_;
+      continue;
+    }
+
+    try {
+      handler();
+      trimmed = trim_pending_;
+    } catch (...) {
+      return nullptr;
+    }
+  }
+}
+
+inline void NewHandler::Deallocate(void* ptr) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->deallocate(ptr);
+    return;
+  }
+
+  if (!ptr) {
+    return;
+  }
+
+  AllocHdr* hdr = static_cast<AllocHdr*>(ptr) - 1;
+
+  if (hdr->domain != kUncharged) {
+    DomainBytes(hdr->domain).fetch_sub(hdr->size, std::memory_order_relaxed);
+  }
+
+  if (hdr->sample) {
+    UnsampleAllocation(hdr);
+  }
+
+  if (trace_fd_ >= 0) {
+    TraceAllocation(-static_cast<int64_t>(hdr->size));
+  }
+
+  free(hdr);
+}
+
+inline void NewHandler::SetTrace(int fd) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->set_trace(fd);
+    return;
+  }
+
+  FlushTrace();
+
+  if (fd >= 0) {
+    TraceHeader header = {};
+
+    memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+    header.version = kTraceVersion;
+    header.record_size = sizeof(TraceRecord);
+
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+      return;
+    }
+#else
+    return;
+#endif
+  }
+
+  trace_fd_ = fd;
+}
+
+inline void NewHandler::TraceAllocation(int64_t size) noexcept {
+  if (untraced_) {
+    // Reserve and final block are not application memory
+    return;
+  }
+
+  uint64_t now = NowNs();
+
+  std::unique_lock<std::mutex> lock(trace_mutex_);
+
+  TraceRecord& record = trace_bufs_[trace_cur_][trace_len_];
+
+  record.time_ns = now;
+  record.size = size;
+  trace_len_++;
+  full_state_.trace_record_count++;
+
+  if (trace_len_ == kTraceRecords) {
+    WriteTrace(lock);
+  }
+}
+
+inline void NewHandler::WriteTrace(
+    std::unique_lock<std::mutex>& lock) noexcept {
+  // Writes go in buffer order, the other buffer is free once the
+  // previous write is done. Appends wait only when both are full.
+  std::lock_guard<std::mutex> write_lock(trace_write_mutex_);
+
+  const char* data = reinterpret_cast<const char*>(trace_bufs_[trace_cur_]);
+  size_t len = trace_len_ * sizeof(TraceRecord);
+  int fd = trace_fd_;
+
+  trace_cur_ ^= 1;
+  trace_len_ = 0;
+
+  lock.unlock();
+
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  size_t done = 0;
+
+  while (fd >= 0 && done < len) {
+    ssize_t res = write(fd, data + done, len - done);
+
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (res <= 0) {
+      break;
+    }
+
+    done += static_cast<size_t>(res);
+  }
+#else
+  (void)data;
+  (void)len;
+  (void)fd;
+#endif
+}
+
+inline void NewHandler::FlushTrace() noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->flush_trace();
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(trace_mutex_);
+
+  WriteTrace(lock);
+}
+
+inline void NewHandler::SetTrim(uint64_t retry_window_ms) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->set_trim(retry_window_ms);
+    return;
+  }
+
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  // Look up allocator hooks now, dlsym() may allocate
+  jemalloc_mallctl_ =
+      reinterpret_cast<int (*)(const char*, void*, size_t*, void*, size_t)>(
+          dlsym(RTLD_DEFAULT, "mallctl"));
+  tcmalloc_release_ = reinterpret_cast<void (*)()>(
+      dlsym(RTLD_DEFAULT, "MallocExtension_ReleaseFreeMemory"));
+#endif
+
+  full_state_.trim_window_ms = retry_window_ms;
+  trim_window_ns_ = retry_window_ms * 1000000;
+}
+
+inline void NewHandler::Trim() noexcept {
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+
+  if (jemalloc_mallctl_) {
+    jemalloc_mallctl_("thread.tcache.flush", nullptr, nullptr, nullptr, 0);
+
+    // 4096 is MALLCTL_ARENAS_ALL
+    jemalloc_mallctl_("arena.4096.purge", nullptr, nullptr, nullptr, 0);
+  }
+
+  if (tcmalloc_release_) {
+    tcmalloc_release_();
+  }
+}
+
+inline bool NewHandler::SetHeapProfile(size_t sample_bytes, int fd,
+                                       size_t top) noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->set_heap_profile(sample_bytes, fd, top);
+  }
+
+#ifdef SIMPLE_NEW_HANDLER_BACKTRACE
+  if (profile_period_ != 0 || sample_bytes == 0) {
+    // Weights of live samples depend on the period
+    return false;
+  }
+
+  // The first backtrace() loads the unwinder, do it while memory
+  // is not short and outside of the operators
+  void* frames[kProfileDepth];
+  backtrace(frames, kProfileDepth);
+
+  profile_fd_ = fd;
+  profile_top_ = top < kProfileTop ? top : kProfileTop;
+  full_state_.heap_profile_period = sample_bytes;
+  profile_period_ = sample_bytes;
+
+  return true;
+#else
+  (void)sample_bytes;
+  (void)fd;
+  (void)top;
+
+  return false;
+#endif
+}
+
+inline int64_t NewHandler::NextSampleInterval() noexcept {
+  // Exponential intervals with the mean of the period, as the
+  // tcmalloc sampler does, so allocation patterns do not alias
+  uint64_t rng = sample_rng_;
+
+  if (rng == 0) {
+    rng = reinterpret_cast<uintptr_t>(&sample_rng_) ^ NowNs() ^ 1;
+  }
+
+  // xorshift64
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  sample_rng_ = rng;
+
+  double unit = static_cast<double>((rng >> 11) + 1) / 9007199254740992.0;
+
+  return static_cast<int64_t>(-std::log(unit) *
+                              static_cast<double>(profile_period_));
+}
+
+inline size_t NewHandler::SampleWeight(size_t size) noexcept {
+  // Inverse of the probability of the allocation to be sampled
+  double period = static_cast<double>(profile_period_);
+  double bytes = static_cast<double>(size);
+  double probability = 1.0 - std::exp(-bytes / period);
+
+  if (probability <= 0) {
+    return profile_period_;
+  }
+
+  return static_cast<size_t>(bytes / probability);
+}
+
+inline void NewHandler::SampleAllocation(AllocHdr* hdr) noexcept {
+  if (sampling_) {
+    return;
+  }
+
+  sampling_ = true;
+  sample_countdown_ = NextSampleInterval();
+
+#ifdef SIMPLE_NEW_HANDLER_BACKTRACE
+  // One extra frame for this function
+  void* frames[kProfileDepth + 1];
+  int depth = backtrace(frames, kProfileDepth + 1);
+
+  if (depth > 1) {
+    // FNV-1a of the return addresses
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int ii = 1; ii < depth; ii++) {
+      hash ^= reinterpret_cast<uintptr_t>(frames[ii]);
+      hash *= 1099511628211ULL;
+    }
+
+    // Zero marks a free slot, kProfileTombstone a retired one
+    hash |= 1;
+
+    // Find the stack on its probe chain, remember the first free or
+    // retired slot to claim if it is not there
+    size_t index = kProfileSlots;
+    size_t reuse = kProfileSlots;
+
+    for (size_t ii = 0; ii < kProfileSlots; ii++) {
+      size_t probe = (hash + ii) % kProfileSlots;
+      uint64_t current = profile_slots_[probe].hash.load(
+          std::memory_order_acquire);
+
+      if (current == hash && AddSample(profile_slots_[probe], hash)) {
+        index = probe;
+        break;
+      }
+
+      if ((current == 0 || current == kProfileTombstone) &&
+          reuse == kProfileSlots) {
+        reuse = probe;
+      }
+
+      if (current == 0) {
+        // End of the chain
+        break;
+      }
+    }
+
+    if (index == kProfileSlots && reuse != kProfileSlots) {
+      ProfileSlot& slot = profile_slots_[reuse];
+      uint64_t current = slot.hash.load(std::memory_order_acquire);
+
+      if ((current == 0 || current == kProfileTombstone) &&
+          slot.hash.compare_exchange_strong(current, hash,
+                                            std::memory_order_acq_rel)) {
+        // Claimed, publish frames with the depth
+        for (int jj = 1; jj < depth; jj++) {
+          slot.frames[jj - 1] = frames[jj];
+        }
+
+        slot.depth.store(static_cast<size_t>(depth - 1),
+                         std::memory_order_release);
+
+        if (AddSample(slot, hash)) {
+          index = reuse;
+        }
+      }
+    }
+
+    if (index != kProfileSlots) {
+      ProfileSlot& slot = profile_slots_[index];
+
+      slot.bytes.fetch_add(SampleWeight(hdr->size), std::memory_order_relaxed);
+      profile_samples_.fetch_add(1, std::memory_order_relaxed);
+
+      hdr->sample = static_cast<unsigned int>(index + 1);
+    } else {
+      profile_dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+#else
+  (void)hdr;
+#endif
+
+  sampling_ = false;
+}
+
+inline void NewHandler::UnsampleAllocation(AllocHdr* hdr) noexcept {
+  ProfileSlot& slot = profile_slots_[hdr->sample - 1];
+
+  slot.bytes.fetch_sub(SampleWeight(hdr->size), std::memory_order_relaxed);
+  profile_samples_.fetch_sub(1, std::memory_order_relaxed);
+
+  DropSample(slot);
+}
+
+inline bool NewHandler::AddSample(ProfileSlot& slot, uint64_t hash) noexcept {
+  size_t count = slot.count.load(std::memory_order_acquire);
+
+  for (;;) {
+    if (count == kProfileRetiring) {
+      // A few stores away from done
+      count = slot.count.load(std::memory_order_acquire);
+      continue;
+    }
+
+    if (slot.count.compare_exchange_weak(count, count + 1,
+                                         std::memory_order_acq_rel)) {
+      break;
+    }
+  }
+
+  if (slot.hash.load(std::memory_order_acquire) != hash) {
+    // Retired and claimed by another stack meanwhile
+    DropSample(slot);
+    return false;
+  }
+
+  return true;
+}
+
+inline void NewHandler::DropSample(ProfileSlot& slot) noexcept {
+  if (slot.count.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+
+  size_t zero = 0;
+
+  if (!slot.count.compare_exchange_strong(zero, kProfileRetiring,
+                                          std::memory_order_acq_rel)) {
+    // Sampled again meanwhile
+    return;
+  }
+
+  // No references, retire the slot for the next stack
+  slot.depth.store(0, std::memory_order_relaxed);
+  slot.bytes.store(0, std::memory_order_relaxed);
+  slot.hash.store(kProfileTombstone, std::memory_order_release);
+  slot.count.store(0, std::memory_order_release);
+}
+
+inline void NewHandler::WriteHeapProfile(int fd) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->write_heap_profile(fd);
+    return;
+  }
+
+  if (fd < 0 || profile_period_ == 0) {
+    return;
+  }
+
+  // Select top slots by live bytes, insertion into a short array
+  size_t top[kProfileTop];
+  size_t top_count = 0;
+
+  for (size_t ii = 0; ii < kProfileSlots; ii++) {
+    const ProfileSlot& slot = profile_slots_[ii];
+    size_t bytes = slot.bytes.load(std::memory_order_relaxed);
+
+    if (!bytes || !slot.depth.load(std::memory_order_acquire)) {
+      continue;
+    }
+
+    size_t pos = top_count;
+
+    while (pos > 0 &&
+           profile_slots_[top[pos - 1]].bytes.load(std::memory_order_relaxed) <
+               bytes) {
+      pos--;
+    }
+
+    if (pos >= profile_top_) {
+      continue;
+    }
+
+    if (top_count < profile_top_) {
+      top_count++;
+    }
+
+    for (size_t jj = top_count - 1; jj > pos; jj--) {
+      top[jj] = top[jj - 1];
+    }
+
+    top[pos] = ii;
+  }
+
+  // Releasing threads dump concurrently, the report has its own
+  // buffer and stays lock-free
+  std::lock_guard<std::mutex> lock(profile_mutex_);
+  ReportBuffer& out = profile_buf_;
+
+  full_state_.heap_profile_dump_count++;
+
+  out.len = 0;
+
+  ReportText(out, "heap_profile: samples ");
+  ReportNumber(out, profile_samples_.load(std::memory_order_relaxed));
+  ReportText(out, " period ");
+  ReportNumber(out, profile_period_);
+  ReportText(out, "\n");
+
+  for (size_t ii = 0; ii < top_count; ii++) {
+    const ProfileSlot& slot = profile_slots_[top[ii]];
+
+    ReportText(out, "heap_stack: bytes ");
+    ReportNumber(out, slot.bytes.load(std::memory_order_relaxed));
+    ReportText(out, " count ");
+    ReportNumber(out, slot.count.load(std::memory_order_relaxed));
+    ReportText(out, "\n");
+    ReportFlush(out, fd);
+
+#ifdef SIMPLE_NEW_HANDLER_BACKTRACE
+    // Does not allocate, one frame per line
+    size_t depth = slot.depth.load(std::memory_order_acquire);
+
+    backtrace_symbols_fd(slot.frames, static_cast<int>(depth), fd);
+#endif
+  }
+
+  ReportFlush(out, fd);
+}
+
+inline uint64_t NewHandler::NowNs() noexcept {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+}
+
+inline void NewHandler::Notify(uint64_t start_ns) noexcept {
+  notify_time_ns_.store(start_ns, std::memory_order_relaxed);
+
+  if (full_state_.signo != 0) std::raise(full_state_.signo);
+
+  NotifyDomains();
+}
+
+inline uint64_t NewHandler::SimulatePressure(size_t level) noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->simulate_pressure(level);
+  }
+
+  uint64_t start = NowNs();
+
+  full_state_.drill_active = true;
+
+  for (size_t ii = 0; ii < level; ii++) {
+    Notify(start);
+  }
+
+  full_state_.drill_active = false;
+
+  uint64_t latency = NowNs() - start;
+
+  full_state_.drill_count++;
+  full_state_.drill_latency_ns = latency;
+
+  Journal(JournalEvent::kDrill, static_cast<uint32_t>(level), latency);
+
+  return latency;
+}
+
+inline void NewHandler::AckPressure() noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->ack_pressure();
+    return;
+  }
+
+  uint64_t notified = notify_time_ns_.load(std::memory_order_relaxed);
+
+  if (notified) {
+    full_state_.reaction_latency_ns = NowNs() - notified;
+  }
+}
+
+inline void NewHandler::NotifyDomains() noexcept {
+  int worst = -1;
+  size_t worst_over = 0;
+
+  for (unsigned int ii = 0; ii < kMaxDomains; ii++) {
+    size_t cap = full_state_.domains[ii].soft_cap;
+    size_t bytes = DomainTotal(ii);
+
+    if (cap == 0 || bytes <= cap) {
+      continue;
+    }
+
+    if (worst < 0 || bytes - cap > worst_over) {
+      worst = static_cast<int>(ii);
+      worst_over = bytes - cap;
+    }
+  }
+
+  if (worst < 0) {
+    return;
+  }
+
+  if (!full_state_.drill_active) {
+    // Drills exercise the callback but are not real pressure
+    full_state_.pressure_domain = worst;
+    full_state_.domains[worst].pressure_count++;
+
+    Journal(JournalEvent::kDomainPressure, static_cast<uint32_t>(worst),
+            worst_over + full_state_.domains[worst].soft_cap);
+  }
+
+  if (domain_callbacks_[worst]) {
+    domain_callbacks_[worst](static_cast<unsigned int>(worst),
+                             domain_contexts_[worst]);
+  }
+}
+
+inline void NewHandler::SetReportFd(int fd) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->set_report_fd(fd);
+    return;
+  }
+
+  full_state_.report_fd = fd;
+}
+
+inline void NewHandler::ReportText(ReportBuffer& out,
+                                   const char* text) noexcept {
+  while (*text && out.len < kReportBufferSize) {
+    out.data[out.len++] = *text++;
+  }
+}
+
+inline void NewHandler::ReportNumber(ReportBuffer& out,
+                                     uint64_t value) noexcept {
+  char digits[24];
+  size_t count = 0;
+
+  do {
+    digits[count++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value);
+
+  while (count && out.len < kReportBufferSize) {
+    out.data[out.len++] = digits[--count];
+  }
+}
+
+inline void NewHandler::ReportField(ReportBuffer& out, const char* name,
+                                    uint64_t value) noexcept {
+  ReportText(out, name);
+  ReportText(out, ": ");
+  ReportNumber(out, value);
+  ReportText(out, "\n");
+}
+
+inline void NewHandler::ReportFlush(ReportBuffer& out, int fd) noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  size_t done = 0;
+
+  while (done < out.len) {
+    ssize_t res = write(fd, out.data + done, out.len - done);
+
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (res <= 0) {
+      break;
+    }
+
+    done += static_cast<size_t>(res);
+  }
+#else
+  (void)fd;
+#endif
+
+  out.len = 0;
+}
+
+inline void NewHandler::WriteReport(int fd) noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->write_report(fd);
+    return;
+  }
+
+  if (fd < 0) {
+    return;
+  }
+
+  // Copy to read consistent values while other threads go on
+  FullState state = GetFullState();
+
+  ReportBuffer& out = report_buf_;
+
+  out.len = 0;
+
+  ReportText(out, "simple::NewHandler report\n");
+  ReportField(out, "init_done", state.init_done);
+  ReportField(out, "chained", state.chained);
+  ReportField(out, "signo", static_cast<uint64_t>(state.signo));
+  ReportField(out, "final_block_size", state.final_block_size);
+  ReportField(out, "final_block_allocated", state.final_block_allocated);
+  ReportField(out, "reserved_block_size", state.reserved_block_size);
+  ReportField(out, "reserved_block_count", state.reserved_block_count);
+  ReportField(out, "reserve_mode", static_cast<uint64_t>(state.reserve_mode));
+  ReportField(out, "allocated_block_count", state.state.allocated_block_count);
+  ReportField(out, "available_block_count", state.state.available_block_count);
+  ReportField(out, "critical_watermark", state.critical_watermark);
+  ReportField(out, "critical_released_block_count",
+              state.critical_released_block_count);
+  ReportField(out, "best_effort_released_block_count",
+              state.best_effort_released_block_count);
+  ReportField(out, "best_effort_rejected_count",
+              state.best_effort_rejected_count);
+  ReportField(out, "lent_block_count", state.lent_block_count);
+  ReportField(out, "revoked_block_count", state.revoked_block_count);
+  ReportField(out, "usage_limit", state.usage_limit);
+  ReportField(out, "usage_bytes", state.usage_bytes);
+  ReportField(out, "exhaustion_estimate_sec", state.exhaustion_estimate_sec);
+  ReportField(out, "exhaustion_alert_count", state.exhaustion_alert_count);
+  ReportField(out, "drill_count", state.drill_count);
+  ReportField(out, "drill_latency_ns", state.drill_latency_ns);
+  ReportField(out, "reaction_latency_ns", state.reaction_latency_ns);
+  ReportField(out, "reserve_pending", state.reserve_pending);
+  ReportField(out, "partial_release_step", state.partial_release_step);
+  ReportField(out, "partial_block_count", state.partial_block_count);
+  ReportField(out, "partial_release_count", state.partial_release_count);
+  ReportField(out, "partial_release_bytes", state.partial_release_bytes);
+  ReportField(out, "critical_partial_release_bytes",
+              state.critical_partial_release_bytes);
+  ReportField(out, "best_effort_partial_release_bytes",
+              state.best_effort_partial_release_bytes);
+  ReportField(out, "numa_node_count", state.numa_node_count);
+
+  for (unsigned int ii = 0; ii < state.numa_node_count; ii++) {
+    ReportText(out, "numa_available: ");
+    ReportNumber(out, numa_nodes_[ii]);
+    ReportText(out, " ");
+    ReportNumber(out, state.numa_available[ii]);
+    ReportText(out, "\n");
+  }
+
+  ReportField(out, "numa_local_release_count", state.numa_local_release_count);
+  ReportField(out, "numa_remote_release_count",
+              state.numa_remote_release_count);
+  ReportField(out, "numa_bind_error_count", state.numa_bind_error_count);
+  ReportField(out, "journal_capacity", state.journal_capacity);
+  ReportField(out, "heap_profile_period", state.heap_profile_period);
+  ReportField(out, "heap_profile_sample_count",
+              state.heap_profile_sample_count);
+  ReportField(out, "heap_profile_dropped_count",
+              state.heap_profile_dropped_count);
+  ReportField(out, "heap_profile_dump_count", state.heap_profile_dump_count);
+  ReportField(out, "trim_window_ms", state.trim_window_ms);
+  ReportField(out, "trim_count", state.trim_count);
+  ReportField(out, "trim_resolved_count", state.trim_resolved_count);
+  ReportField(out, "trace_record_count", state.trace_record_count);
+  ReportField(out, "coordinator_connected", state.coordinator_connected);
+  ReportField(out, "coordinator_priority", state.coordinator_priority);
+  ReportField(out, "coordinator_shed_count", state.coordinator_shed_count);
+  ReportField(out, "coordinator_release_count",
+              state.coordinator_release_count);
+  ReportField(out, "drain_deadline_ms", state.drain_deadline_ms);
+  ReportField(out, "draining", state.draining);
+  ReportField(out, "drain_timed_out", state.drain_timed_out);
+  ReportField(out, "drain_ns", state.drain_ns);
+
+  for (unsigned int ii = 0; ii < kMaxDomains; ii++) {
+    if (!state.domains[ii].bytes && !state.domains[ii].soft_cap) {
+      continue;
+    }
+
+    ReportText(out, "domain: ");
+    ReportNumber(out, ii);
+    ReportText(out, " ");
+    ReportText(out, state.domains[ii].name ? state.domains[ii].name : "-");
+    ReportText(out, " bytes ");
+    ReportNumber(out, state.domains[ii].bytes);
+    ReportText(out, " soft_cap ");
+    ReportNumber(out, state.domains[ii].soft_cap);
+    ReportText(out, " pressure_count ");
+    ReportNumber(out, state.domains[ii].pressure_count);
+    ReportText(out, "\n");
+  }
+
+  // Most recent release goes first
+  size_t count = release_count_;
+  size_t history = count < kReleaseHistory ? count : kReleaseHistory;
+
+  for (size_t ii = 0; ii < history; ii++) {
+    const timespec& ts = release_times_[(count - 1 - ii) % kReleaseHistory];
+
+    ReportText(out, "release_time: ");
+    ReportNumber(out, static_cast<uint64_t>(ts.tv_sec));
+    ReportText(out, ".");
+
+    // Nanoseconds with leading zeros
+    for (uint64_t div = 100000000; div > 0; div /= 10) {
+      ReportNumber(out, static_cast<uint64_t>(ts.tv_nsec) / div % 10);
+    }
+
+    ReportText(out, "\n");
+  }
+
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  int statm_fd = open("/proc/self/statm", O_RDONLY);
+
+  if (statm_fd >= 0) {
+    ReportText(out, "statm: ");
+
+    ssize_t res = read(statm_fd, out.data + out.len,
+                       kReportBufferSize - out.len);
+
+    if (res > 0) {
+      out.len += static_cast<size_t>(res);
+    } else {
+      ReportText(out, "\n");
+    }
+
+    close(statm_fd);
+  }
+#endif
+
+  ReportFlush(out, fd);
+}
+
+inline bool NewHandler::SetJournal(const char* path,
+                                   size_t record_count) noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->set_journal(path, record_count);
+  }
+
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  if (journal_records_.load(std::memory_order_relaxed) ||
+      record_count == 0) {
+    return false;
+  }
+
+  size_t size = sizeof(JournalHeader) + record_count * sizeof(JournalRecord);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+  if (fd < 0) {
+    return false;
+  }
+
+  void* addr = MAP_FAILED;
+
+  if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+    addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+
+  close(fd);
+
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+
+  // Touch every page now, not when memory is short
+  memset(addr, 0, size);
+
+  JournalHeader* header = static_cast<JournalHeader*>(addr);
+
+  memcpy(header->magic, kJournalMagic, sizeof(header->magic));
+  header->version = kJournalVersion;
+  header->record_size = sizeof(JournalRecord);
+  header->capacity = record_count;
+  header->pid = static_cast<uint64_t>(getpid());
+
+  timespec ts;
+  timespec_get(&ts, TIME_UTC);
+
+  header->start_time_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000 +
+                          static_cast<uint64_t>(ts.tv_nsec);
+
+  // Capacity goes first, Journal() may run concurrently
+  journal_header_ = header;
+  full_state_.journal_capacity = record_count;
+  journal_records_.store(reinterpret_cast<JournalRecord*>(header + 1),
+                         std::memory_order_release);
+
+  return true;
+#else
+  (void)path;
+  (void)record_count;
+
+  return false;
+#endif
+}
+
+inline void NewHandler::Journal(JournalEvent event, uint32_t arg,
+                                uint64_t value, uint64_t extra) noexcept {
+  JournalRecord* records = journal_records_.load(std::memory_order_acquire);
+
+  if (!records) {
+    return;
+  }
+
+  uint64_t seq = journal_seq_.fetch_add(1, std::memory_order_relaxed) + 1;
+  JournalRecord* record = &records[(seq - 1) % full_state_.journal_capacity];
+
+  // Wall clock time, served without a system call where vDSO is
+  timespec ts;
+  timespec_get(&ts, TIME_UTC);
+
+  // Invalidate the record while it is being written
+  record->seq = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+
+  record->time_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000 +
+                    static_cast<uint64_t>(ts.tv_nsec);
+  record->event = static_cast<uint32_t>(event);
+  record->arg = arg;
+  record->available = available_block_count_;
+  record->allocated = full_state_.state.allocated_block_count;
+  record->value = value;
+  record->extra = extra;
+
+  std::atomic_thread_fence(std::memory_order_release);
+  record->seq = seq;
+}
+
+inline void NewHandler::JournalSnapshot() noexcept {
+  if (const Registry* remote = Remote()) {
+    remote->journal_snapshot();
+    return;
+  }
+
+  Journal(JournalEvent::kSnapshot,
+          static_cast<uint32_t>(full_state_.lent_block_count),
+          full_state_.usage_bytes, full_state_.exhaustion_estimate_sec);
+}
+
+inline bool NewHandler::Rejects(bool critical) noexcept {
+  return !critical && critical_watermark_ != 0 &&
+         available_block_count_ <= critical_watermark_;
+}
+
+inline bool NewHandler::Admit(bool critical) noexcept {
+  if (Rejects(critical)) {
+    // The rest of the reserve belongs to critical threads
+    full_state_.best_effort_rejected_count++;
+    Journal(JournalEvent::kReject, 0, 0);
+    return false;
+  }
+
+  return true;
+}
+
+inline bool NewHandler::ReleaseBlock(bool critical) noexcept {
+  Blk* blk_arr = nullptr;
+  size_t blk_size = 0;
+  RevokeCallback revoke = nullptr;
+  void* context = nullptr;
+  char* tail = nullptr;
+  size_t node = 0;
+  bool revoked = false;
+
+  // Partial release step, large enough for the failed request
+  size_t page = PageSize();
+  size_t step = full_state_.partial_release_step;
+
+  if (step != 0) {
+    size_t request = (request_size_ + 2 * page - 1) / page * page;
+
+    if (request > step) step = request;
+  }
+
+  request_size_ = 0;
+
+  int local_node = LocalNode();
+
+  {
+    ListLock lock;
+
+    // Prefer a block local to the failing thread
+    Blk** link = &blk_arr_list_;
+
+    if (local_node >= 0) {
+      while (*link && (*link)[0].m_node != static_cast<size_t>(local_node)) {
+        link = &(*link)[0].m_next;
+      }
+
+      if (!*link) {
+        link = &blk_arr_list_;
+      }
+    }
+
+    blk_arr = *link;
+
+    if (blk_arr) {
+      node = blk_arr[0].m_node;
+    }
+
+    if (blk_arr && local_node >= 0) {
+      if (blk_arr[0].m_node == static_cast<size_t>(local_node)) {
+        full_state_.numa_local_release_count++;
+      } else {
+        full_state_.numa_remote_release_count++;
+      }
+    }
+
+    if (blk_arr && step != 0 && blk_arr[0].m_size > step + page) {
+      // Unmap the tail, the block stays in the list
+      if (blk_arr[0].m_size == BlockBytes()) {
+        full_state_.partial_block_count++;
+      }
+
+      blk_arr[0].m_size -= step;
+      tail = reinterpret_cast<char*>(blk_arr) + blk_arr[0].m_size;
+
+      full_state_.partial_release_count++;
+      full_state_.partial_release_bytes += step;
+
+      // Blocks are counted by class when consumed, steps by bytes
+      if (critical) {
+        full_state_.critical_partial_release_bytes += step;
+      } else {
+        full_state_.best_effort_partial_release_bytes += step;
+      }
+
+      blk_arr = nullptr;
+    } else if (blk_arr) {
+      *link = blk_arr[0].m_next;
+      blk_size = blk_arr[0].m_size;
+
+      if (full_state_.numa_node_count) {
+        full_state_.numa_available[blk_arr[0].m_node]--;
+      }
+
+      if (blk_size != BlockBytes()) {
+        full_state_.partial_block_count--;
+      }
+    } else if (lent_list_) {
+      // No idle blocks, reclaim the most recently lent one
+      ReserveLease* lease = lent_list_;
+      lent_list_ = lease->next_;
+
+      blk_arr = static_cast<Blk*>(lease->data_);
+      blk_size = lease->size_;
+      node = lease->node_;
+      revoked = true;
+
+      if (full_state_.numa_node_count) {
+        full_state_.numa_available[lease->node_]--;
+      }
+
+      // A partially released head block may have been lent
+      if (blk_size != BlockBytes()) {
+        full_state_.partial_block_count--;
+      }
+
+      revoke = lease->revoke_;
+      context = lease->context_;
+
+      lease->data_ = nullptr;
+      lease->next_ = nullptr;
+
+      full_state_.lent_block_count--;
+      full_state_.revoked_block_count++;
+    }
+
+    if (blk_arr && available_block_count_ > 0) {
+      available_block_count_--;
+
+      // Note: we do not decrement this field in full_state
+      // to avoid issues with concurrent access to full state
+      full_state_.state.available_block_count = available_block_count_;
+    }
+  }
+
+  if (blk_arr || tail) {
+    // Release the first avalable block or its tail to the process
+    // and raise signal if configured
+    if (revoke) {
+      revoke(context, blk_arr, blk_size);
+    }
+
+    uint32_t arg = static_cast<uint32_t>(node);
+
+    if (blk_arr) {
+      FreeBlock(blk_arr, blk_size);
+
+      Journal(revoked ? JournalEvent::kRevoke : JournalEvent::kRelease, arg,
+              blk_size);
+
+      if (critical) {
+        full_state_.critical_released_block_count++;
+      } else {
+        full_state_.best_effort_released_block_count++;
+      }
+    } else {
+      FreeBlock(reinterpret_cast<Blk*>(tail), step);
+
+      Journal(JournalEvent::kPartialRelease, arg, step);
+    }
+
+    if (profile_fd_ >= 0) {
+      WriteHeapProfile(profile_fd_);
+    }
+
+    CoordinatorSend(coordinator_thread_ ? "RELEASED" : "PRESSURE");
+
+    // Keep release history for the report
+    timespec_get(&release_times_[release_count_ % kReleaseHistory],
+                 TIME_UTC);
+    release_count_++;
+
+    Notify(NowNs());
+
+    return true;
+  }
+
+  return false;
+}
+
+inline bool NewHandler::ConnectCoordinator(const char* path,
+                                           unsigned int priority,
+                                           ShedCallback shed,
+                                           void* context) noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->connect_coordinator(path, priority, shed, context);
+  }
+
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  if (coordinator_fd_ >= 0) {
+    return false;
+  }
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return false;
+  }
+
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0) {
+    return false;
+  }
+
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return false;
+  }
+
+  coordinator_fd_ = fd;
+  coordinator_shed_ = shed;
+  coordinator_context_ = context;
+  full_state_.coordinator_priority = priority;
+
+  try {
+    std::thread(CoordinatorListen, fd).detach();
+  } catch (...) {
+    CoordinatorDisconnect();
+    return false;
+  }
+
+  full_state_.coordinator_connected = true;
+
+  if (full_state_.init_done && !full_state_.reserve_pending) {
+    CoordinatorSend("REGISTER");
+  }
+
+  return true;
+#else
+  (void)path;
+  (void)priority;
+  (void)shed;
+  (void)context;
+
+  return false;
+#endif
+}
+
+inline void NewHandler::CoordinatorSend(const char* verb) noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  // Keep the socket open while it is used
+  coordinator_senders_.fetch_add(1);
+
+  int fd = coordinator_fd_.load();
+
+  if (fd < 0) {
+    coordinator_senders_.fetch_sub(1);
+    return;
+  }
+
+  char buf[128];
+  int len = snprintf(buf, sizeof(buf), "%s %ld %u %zu %u\n", verb,
+                     static_cast<long>(getpid()),
+                     full_state_.coordinator_priority,
+                     full_state_.state.allocated_block_count,
+                     available_block_count_);
+
+  int flags = MSG_DONTWAIT;
+#ifdef MSG_NOSIGNAL
+  flags |= MSG_NOSIGNAL;
+#endif
+
+  // Best effort, never blocks the failing thread
+  send(fd, buf, static_cast<size_t>(len), flags);
+
+  coordinator_senders_.fetch_sub(1);
+#else
+  (void)verb;
+#endif
+}
+
+inline void NewHandler::CoordinatorListen(int fd) noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  coordinator_thread_ = true;
+
+  char buf[256];
+  size_t len = 0;
+
+  for (;;) {
+    ssize_t res = read(fd, buf + len, sizeof(buf) - 1 - len);
+
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (res <= 0) {
+      break;
+    }
+
+    len += static_cast<size_t>(res);
+
+    // Run complete lines, keep the rest
+    char* start = buf;
+    char* end = buf + len;
+    char* eol;
+
+    while ((eol = static_cast<char*>(memchr(start, '\n', end - start)))) {
+      *eol = 0;
+      CoordinatorCommand(start);
+      start = eol + 1;
+    }
+
+    len = static_cast<size_t>(end - start);
+    memmove(buf, start, len);
+
+    if (len == sizeof(buf) - 1) {
+      // Line too long, drop it
+      len = 0;
+    }
+  }
+
+  // Coordinator is gone
+  full_state_.coordinator_connected = false;
+
+  CoordinatorDisconnect();
+#else
+  (void)fd;
+#endif
+}
+
+inline void NewHandler::CoordinatorDisconnect() noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  int fd = coordinator_fd_.exchange(-1);
+
+  // A sender that got the descriptor must not write to a reused one
+  while (coordinator_senders_.load() != 0) {
+    std::this_thread::yield();
+  }
+
+  close(fd);
+#endif
+}
+
+inline void NewHandler::CoordinatorCommand(const char* command) noexcept {
+  if (strcmp(command, "SHED") == 0) {
+    full_state_.coordinator_shed_count++;
+
+    if (coordinator_shed_) {
+      coordinator_shed_(coordinator_context_);
+    }
+  } else if (strcmp(command, "RELEASE") == 0) {
+    // Not a failed allocation, bypass Admit() and its accounting
+    if (critical_watermark_ != 0 &&
+        available_block_count_ <= critical_watermark_) {
+      return;
+    }
+
+    if (ReleaseBlock(false)) {
+      full_state_.coordinator_release_count++;
+    }
+  }
+}
+
+inline bool NewHandler::SetDrainHook(DrainHook hook, uint64_t deadline_ms,
+                                     void* context) noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->set_drain_hook(hook, deadline_ms, context);
+  }
+
+  if (drain_hook_ || !hook) {
+    return false;
+  }
+
+  if (deadline_ms != 0) {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+    // Start the watchdog now, a thread can not be created on exhaustion
+    if (pipe(drain_pipe_) != 0) {
+      return false;
+    }
+
+    full_state_.drain_deadline_ms = deadline_ms;
+
+    try {
+      std::thread(DrainWatchdog).detach();
+    } catch (...) {
+      full_state_.drain_deadline_ms = 0;
+      close(drain_pipe_[0]);
+      close(drain_pipe_[1]);
+      drain_pipe_[0] = drain_pipe_[1] = -1;
+      return false;
+    }
+#else
+    return false;
+#endif
+  }
+
+  drain_context_ = context;
+  drain_hook_ = hook;
+
+  return true;
+}
+
+inline void NewHandler::Drain() noexcept {
+  drainer_ = true;
+  critical_depth_++;
+
+  full_state_.draining = true;
+
+  Journal(JournalEvent::kDrain, 0, full_state_.drain_deadline_ms);
+
+  uint64_t start = NowNs();
+
+  // Start the deadline, then stop it when the hook returns
+  DrainSignal();
+
+  drain_hook_(drain_context_);
+
+  DrainSignal();
+
+  full_state_.drain_ns = NowNs() - start;
+
+  critical_depth_--;
+}
+
+inline void NewHandler::DrainSignal() noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  if (drain_pipe_[1] < 0) {
+    return;
+  }
+
+  char byte = 'd';
+
+  while (write(drain_pipe_[1], &byte, 1) < 0 && errno == EINTR) {
+  }
+#endif
+}
+
+inline void NewHandler::DrainWatchdog() noexcept {
+#ifdef SIMPLE_NEW_HANDLER_POSIX
+  // Blocked in read() the thread does not hold a normal exit
+  char byte;
+  ssize_t res;
+
+  while ((res = read(drain_pipe_[0], &byte, 1)) < 0 && errno == EINTR) {
+  }
+
+  if (res != 1) {
+    return;
+  }
+
+  uint64_t deadline = NowNs() + full_state_.drain_deadline_ms * 1000000;
+
+  for (;;) {
+    uint64_t now = NowNs();
+
+    if (now >= deadline) {
+      break;
+    }
+
+    pollfd pfd = {drain_pipe_[0], POLLIN, 0};
+    int timeout = static_cast<int>((deadline - now + 999999) / 1000000);
+
+    res = poll(&pfd, 1, timeout);
+
+    if (res > 0) {
+      // The hook returned in time
+      return;
+    }
+
+    if (res < 0 && errno != EINTR) {
+      break;
+    }
+  }
+
+  // The hook is stuck, do not let it hold the process
+  full_state_.drain_timed_out = true;
+
+  Journal(JournalEvent::kDrainTimeout, 0, full_state_.drain_deadline_ms);
+
+  std::terminate();
+#endif
+}
+
+inline bool NewHandler::ReleaseReserve() noexcept {
+  if (const Registry* remote = Remote()) {
+    return remote->release_reserve();
+  }
+
+  if (building_) {
+    return false;
+  }
+
+  if (TrimFirst()) {
+    return true;
+  }
+
+  bool critical = critical_depth_ > 0;
+
+  // Under the preloaded shim operator new fails in malloc() first and
+  // then calls the new-handler: leave rejections and exhaustion to it,
+  // with the trim still pending, so they are counted once
+  if (Rejects(critical) || !ReleaseBlock(critical)) {
+    return false;
+  }
+
+  trim_pending_ = false;
+
+  return true;
+}
+
+inline bool NewHandler::TrimFirst() noexcept {
+  if (trim_window_ns_ == 0) {
+    return false;
+  }
+
+  uint64_t now = NowNs();
+
+  // Trim unless this thread failed again right after a trim
+  if (trim_pending_ && now < trim_deadline_ns_) {
+    return false;
+  }
+
+  Trim();
+
+  trim_pending_ = true;
+  trim_deadline_ns_ = now + trim_window_ns_;
+  full_state_.trim_count++;
+
+  Journal(JournalEvent::kTrim, 0, 0);
+
+  return true;
+}
+
+inline void NewHandler::Process() {
+  if (building_) {
+    // Reserve is being built on this thread, fail the allocation
+    // instead of releasing blocks just allocated
+    throw std::bad_alloc();
+  }
+
+  if (TrimFirst()) {
+    return;
+  }
+
+  trim_pending_ = false;
+
+  bool critical = critical_depth_ > 0;
+
+  if (!Admit(critical)) {
+    // Let the best-effort caller handle the failure
+    throw std::bad_alloc();
+  }
+
+  if (ReleaseBlock(critical)) {
+    return;
+  }
+
+  if (drain_hook_ && draining_.exchange(true, std::memory_order_acq_rel)) {
+    if (drainer_) {
+      // The drain hook ran out of memory
+      std::terminate();
+    }
+
+    // Another thread drains the process
+    throw std::bad_alloc();
+  }
+
+  // Report, release final block, drain if configured and terminate or
+  // call chained handler
+  Journal(JournalEvent::kExhausted, 0, 0);
+  CoordinatorSend("EXHAUSTED");
+  WriteReport(full_state_.report_fd);
+
+  untraced_ = true;
   delete[] final_block_;
+  untraced_ = false;
   final_block_ = 0;
 
+  FlushTrace();
+
+  if (drain_hook_) {
+    Drain();
+  }
+
   if (prev_handler_) {
     std::set_new_handler(prev_handler_);
     prev_handler_();
@@ -223,4 +3333,51 @@ inline void NewHandler::Process() noexcept {
 
 }  // namespace simple
 
+// Replacement operators, define SIMPLE_NEW_HANDLER_DEFINE_OPERATORS
+// in exactly one source file to enable domain accounting
+//
+#ifdef SIMPLE_NEW_HANDLER_DEFINE_OPERATORS
+
+void* operator new(size_t size) {
+  return simple::NewHandler::Allocate(size, false);
+}
+
+void* operator new[](size_t size) {
+  return simple::NewHandler::Allocate(size, false);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return simple::NewHandler::Allocate(size, true);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return simple::NewHandler::Allocate(size, true);
+}
+
+void operator delete(void* ptr) noexcept {
+  simple::NewHandler::Deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  simple::NewHandler::Deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  simple::NewHandler::Deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  simple::NewHandler::Deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  simple::NewHandler::Deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  simple::NewHandler::Deallocate(ptr);
+}
+
+#endif  // SIMPLE_NEW_HANDLER_DEFINE_OPERATORS
+
 #endif  // INCLUDE_SIMPLE_NEW_HANDLER_H_
@@ -0,0 +1,84 @@
+// Copyright (C) 2020  Aleksey Romanov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Test plugin with its own copy of the handler, it is built with hidden
+// visibility and -Bsymbolic and must bind to the reserve of the program
+//
+
+#include <simple_new_handler.h>
+
+extern "C" __attribute__((visibility("default"))) int TestPlugin(
+    size_t reserved_block_count, size_t available_block_count) {
+  // Init of the plugin copy must have no effect
+  simple::NewHandler::Init(0, 1, 1024);
+
+  simple::NewHandler::FullState fullState = simple::NewHandler::GetFullState();
+
+  if (fullState.reserved_block_count != reserved_block_count) {
+    return 1;
+  }
+
+  if (fullState.state.available_block_count != available_block_count) {
+    return 2;
+  }
+
+  // Reserve settings of the plugin copy must have no effect
+  simple::NewHandler::SetReserveMode(
+      fullState.reserve_mode == simple::NewHandler::ReserveMode::kMmap
+          ? simple::NewHandler::ReserveMode::kHeap
+          : simple::NewHandler::ReserveMode::kMmap);
+  simple::NewHandler::SetNumaReserve();
+
+  if (simple::NewHandler::GetFullState().reserve_mode !=
+      fullState.reserve_mode) {
+    return 3;
+  }
+
+  // Async init reports the reserve of the program copy
+  size_t done_count = 0;
+
+  simple::NewHandler::InitAsync(
+      0, 1, 1024, 0, false,
+      [](simple::NewHandler::State state, void* context) {
+        if (state.allocated_block_count != 0) {
+          ++*static_cast<size_t*>(context);
+        }
+      },
+      &done_count);
+
+  if (done_count != 1) {
+    return 4;
+  }
+
+  // Partial release step is set on the program copy
+  if (fullState.reserve_mode == simple::NewHandler::ReserveMode::kMmap) {
+    if (!simple::NewHandler::SetPartialRelease(1) ||
+        simple::NewHandler::GetFullState().partial_release_step == 0) {
+      return 5;
+    }
+
+    simple::NewHandler::SetPartialRelease(fullState.partial_release_step);
+  }
+
+  // Drill through the plugin copy must reach the program copy
+  simple::NewHandler::SimulatePressure(1);
+
+  return 0;
+}
@@ -21,16 +21,29 @@
 // Test program for sane new handler
 //
 
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <simple_new_handler.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <csignal>
+#include <cstring>
+#include <fstream>
 #include <exception>
 #include <iostream>
 #include <new>
+#include <string>
+#include <thread>
 #include <utility>
 
 static size_t const MB = 1024 * 1024;
@@ -38,10 +51,429 @@ static size_t alloc_count = 0;
 static bool do_chain = false;
 static bool debug = false;
 static bool have_signal = false;
+static int signo = 0;
+static size_t const lend_count = 3;
+static size_t lent_count = 0;
+static size_t revoked_count = 0;
+static bool domains = false;
+static size_t pressure_count = 0;
+static std::atomic<bool> init_done(false);
+static bool partial = false;
+static bool critical = false;
+static bool numa = false;
+static bool report = false;
+static char const* const report_path = "test_report.tmp";
+static bool journal = false;
+static char const* const journal_path = "test_journal.tmp";
+static bool profile = false;
+static char const* const profile_path = "test_profile.tmp";
+static bool trim = false;
+static void* trim_cache = nullptr;
+static bool trace = false;
+static char const* const trace_path = "test_trace.tmp";
+static bool leak_malloc = false;
+static bool coordinator = false;
+static char const* const coordinator_path = "test_coordinator.sock";
+static std::atomic<size_t> shed_count(0);
+static std::atomic<bool> registered(false);
+static bool drain = false;
+static bool normal_exit = false;
+static std::atomic<size_t> drain_count(0);
+
+static void Shed(void* context) {
+  static_cast<std::atomic<size_t>*>(context)->fetch_add(1);
+}
+
+// Drain hook: runs on released final block memory and hangs past
+// the deadline, the watchdog has to terminate
+//
+static void Drain(void* context) {
+  assert(simple::NewHandler::GetFullState().draining);
+
+  char* p = new char[256];
+  *p = 'd';
+
+  static_cast<std::atomic<size_t>*>(context)->fetch_add(1);
+
+  for (;;) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+// Coordinator stand-in: answers the first pressure report with SHED
+// and RELEASE, uses no heap memory
+//
+static void CoordinatorStandIn(int listen_fd) {
+  int fd = accept(listen_fd, nullptr, nullptr);
+  assert(fd >= 0);
+
+  char buf[256];
+  size_t len = 0;
+  bool answered = false;
+
+  for (;;) {
+    ssize_t res = read(fd, buf + len, sizeof(buf) - 1 - len);
+
+    if (res <= 0) {
+      break;
+    }
+
+    len += static_cast<size_t>(res);
+    buf[len] = 0;
+
+    char* eol;
+
+    while ((eol = strchr(buf, '\n'))) {
+      *eol = 0;
+
+      if (strncmp(buf, "REGISTER ", 9) == 0) {
+        registered = true;
+      }
+
+      if (!answered && strncmp(buf, "PRESSURE ", 9) == 0) {
+        const char commands[] = "SHED\nRELEASE\n";
+
+        ssize_t sent = write(fd, commands, sizeof(commands) - 1);
+        assert(sent == sizeof(commands) - 1);
+        answered = true;
+      }
+
+      len -= static_cast<size_t>(eol + 1 - buf);
+      memmove(buf, eol + 1, len + 1);
+    }
+  }
+}
+
+// Stands in for tcmalloc: the handler finds it with dlsym() and the
+// cache it frees lets the first failed allocation succeed on retry
+//
+extern "C" void MallocExtension_ReleaseFreeMemory() {
+  free(trim_cache);
+  trim_cache = nullptr;
+}
+
+// Every failure is trimmed first, only the first one is resolved
+//
+static void CheckTrim() {
+  simple::NewHandler::FullState fullState = simple::NewHandler::GetFullState();
+
+  if (debug) {
+    std::cout << "Trimmed " << fullState.trim_count << " times, resolved "
+              << fullState.trim_resolved_count << "\n";
+  }
+
+  assert(trim_cache == nullptr);
+
+#ifdef SIMPLE_NEW_HANDLER_DEFINE_OPERATORS
+  assert(fullState.trim_resolved_count == 1);
+  assert(fullState.trim_count == fullState.state.allocated_block_count + 2);
+#else
+  assert(fullState.trim_resolved_count == 0);
+  assert(fullState.trim_count >= fullState.state.allocated_block_count);
+#endif
+}
+
+static volatile int churn_sink = 0;
+
+// Allocate and free at one of 10^level distinct stacks picked by 'code'
+//
+__attribute__((noinline)) static void Churn(int level, int code, int site) {
+  if (level == 0) {
+    char* p = new char[4 * MB];
+    p[0] = static_cast<char>(site);
+    delete[] p;
+    return;
+  }
+
+  switch (code % 10) {
+    case 0: Churn(level - 1, code / 10, 0); break;
+    case 1: Churn(level - 1, code / 10, 1); break;
+    case 2: Churn(level - 1, code / 10, 2); break;
+    case 3: Churn(level - 1, code / 10, 3); break;
+    case 4: Churn(level - 1, code / 10, 4); break;
+    case 5: Churn(level - 1, code / 10, 5); break;
+    case 6: Churn(level - 1, code / 10, 6); break;
+    case 7: Churn(level - 1, code / 10, 7); break;
+    case 8: Churn(level - 1, code / 10, 8); break;
+    default: Churn(level - 1, code / 10, 9); break;
+  }
+
+  // No tail calls, every level keeps its return address
+  churn_sink = churn_sink + site;
+}
+
+// More short-lived stacks than profile slots, freed slots are reused
+//
+static void TestProfileChurn() {
+  simple::NewHandler::FullState before = simple::NewHandler::GetFullState();
+
+  for (int code = 0; code < 1000; code++) {
+    Churn(3, code, 0);
+  }
+
+  simple::NewHandler::FullState fullState = simple::NewHandler::GetFullState();
+
+  if (debug) {
+    std::cout << "Heap profile churn dropped "
+              << fullState.heap_profile_dropped_count << "\n";
+  }
+
+  assert(simple::NewHandler::kProfileSlots < 1000);
+  assert(fullState.heap_profile_dropped_count ==
+         before.heap_profile_dropped_count);
+  assert(fullState.heap_profile_sample_count ==
+         before.heap_profile_sample_count);
+}
+
+// Leaking stack is on top of the last heap profile dump
+//
+static void CheckProfile() {
+  simple::NewHandler::FullState fullState = simple::NewHandler::GetFullState();
+
+  assert(fullState.heap_profile_dump_count ==
+         fullState.state.allocated_block_count);
+  assert(fullState.heap_profile_sample_count > 0);
+  assert(fullState.heap_profile_dropped_count == 0);
+
+  std::ifstream file(profile_path);
+  std::string line;
+  std::string top;
+  bool first = false;
+
+  while (std::getline(file, line)) {
+    if (line.rfind("heap_profile:", 0) == 0) {
+      first = true;
+    } else if (first && line.rfind("heap_stack:", 0) == 0) {
+      top = line;
+      first = false;
+    }
+  }
+
+  if (debug) {
+    std::cout << "Heap profile top " << top << "\n";
+  }
+
+  // heap_stack: bytes <n> count <n>
+  size_t bytes = strtoul(top.c_str() + strlen("heap_stack: bytes "), 0, 10);
+
+  assert(bytes >= 100 * MB);
+}
+
+// Journal holds init, every block release and the exhaustion
+//
+static void CheckJournal() {
+  using Handler = simple::NewHandler;
+
+  simple::NewHandler::FullState fullState = Handler::GetFullState();
+  std::ifstream file(journal_path, std::ios::binary);
+  Handler::JournalHeader header;
+
+  file.read(reinterpret_cast<char*>(&header), sizeof(header));
+  assert(file);
+  assert(memcmp(header.magic, Handler::kJournalMagic, 8) == 0);
+  assert(header.capacity == fullState.journal_capacity);
+  assert(header.reserved_block_count == 10);
+
+  size_t init_count = 0;
+  size_t release_count = 0;
+  Handler::JournalRecord last = {};
+
+  for (uint64_t ii = 0; ii < header.capacity; ii++) {
+    Handler::JournalRecord record;
+
+    file.read(reinterpret_cast<char*>(&record), sizeof(record));
+    assert(file);
+
+    if (record.seq == 0) {
+      continue;
+    }
+
+    if (record.event == static_cast<uint32_t>(Handler::JournalEvent::kInit)) {
+      init_count++;
+    }
+
+    if (record.event ==
+        static_cast<uint32_t>(Handler::JournalEvent::kRelease)) {
+      release_count++;
+    }
+
+    if (record.seq > last.seq) {
+      last = record;
+    }
+  }
+
+  if (debug) {
+    std::cout << "Journal " << last.seq << " records, " << release_count
+              << " releases\n";
+  }
+
+  assert(init_count == 1);
+  assert(release_count == fullState.state.allocated_block_count);
+  // Drain hook past its deadline is the last event
+  Handler::JournalEvent event = drain ? Handler::JournalEvent::kDrainTimeout
+                                      : Handler::JournalEvent::kExhausted;
+
+  assert(last.event == static_cast<uint32_t>(event));
+  assert(last.available == 0);
+}
+
+// Report is written before terminate, the reserve is empty
+//
+static void CheckReport() {
+  std::ifstream file(report_path);
+  std::string line;
+  bool header = false;
+  bool available = false;
+  bool statm = false;
+  size_t release_times = 0;
+
+  while (std::getline(file, line)) {
+    if (line == "simple::NewHandler report") {
+      header = true;
+    } else if (line == "available_block_count: 0") {
+      available = true;
+    } else if (line.compare(0, 14, "release_time: ") == 0) {
+      release_times++;
+    } else if (line.compare(0, 7, "statm: ") == 0) {
+      statm = true;
+    }
+  }
+
+  if (debug) {
+    std::cout << "Report " << release_times << " release times\n";
+  }
+
+  assert(header);
+  assert(available);
+  assert(statm);
+  assert(release_times == 8);
+}
 
 static void TerminateHandler() {
   // Do normal exit instead of abort
   assert(!do_chain);
+  assert(revoked_count == lent_count);
+
+  if (numa) {
+    // Blocks local to the only CPU node go first, then the rest
+    simple::NewHandler::FullState fullState =
+        simple::NewHandler::GetFullState();
+
+    if (debug) {
+      std::cout << "NUMA local releases " << fullState.numa_local_release_count
+                << ", remote releases " << fullState.numa_remote_release_count
+                << "\n";
+    }
+
+    // Partial releases are counted by steps
+    size_t steps = partial ? 5 : 1;
+
+    assert(fullState.numa_local_release_count ==
+           (fullState.state.allocated_block_count + 1) / 2 * steps);
+    assert(fullState.numa_remote_release_count ==
+           fullState.state.allocated_block_count / 2 * steps);
+    assert(fullState.numa_available[0] == 0);
+    assert(fullState.numa_available[1] == 0);
+  }
+
+  if (partial) {
+    // Blocks have been released in steps
+    simple::NewHandler::FullState fullState =
+        simple::NewHandler::GetFullState();
+
+    if (debug) {
+      std::cout << "Partial releases " << fullState.partial_release_count
+                << ", " << fullState.partial_release_bytes << " bytes\n";
+    }
+
+    assert(fullState.partial_release_count >
+           fullState.state.allocated_block_count);
+    assert(fullState.partial_block_count == 0);
+
+    // Steps are charged to the class of the failing thread
+    assert(fullState.critical_partial_release_bytes +
+               fullState.best_effort_partial_release_bytes ==
+           fullState.partial_release_bytes);
+    assert(critical ? fullState.critical_partial_release_bytes != 0
+                    : fullState.critical_partial_release_bytes == 0);
+  }
+
+  if (report) {
+    CheckReport();
+  }
+
+  if (journal) {
+    CheckJournal();
+  }
+
+  if (profile) {
+    CheckProfile();
+  }
+
+  if (trim) {
+    CheckTrim();
+  }
+
+  if (coordinator) {
+    // One pressure report got one SHED and one RELEASE
+    simple::NewHandler::FullState fullState =
+        simple::NewHandler::GetFullState();
+
+    if (debug) {
+      std::cout << "Coordinator shed " << fullState.coordinator_shed_count
+                << ", released " << fullState.coordinator_release_count
+                << "\n";
+    }
+
+    assert(registered);
+    assert(fullState.coordinator_connected);
+    assert(fullState.coordinator_priority == 5);
+    assert(fullState.coordinator_shed_count == 1);
+    assert(shed_count == 1);
+    assert(fullState.coordinator_release_count == 1);
+  }
+
+  if (drain) {
+    // Watchdog terminated the stuck drain hook
+    simple::NewHandler::FullState fullState =
+        simple::NewHandler::GetFullState();
+
+    if (debug) {
+      std::cout << "Drain deadline " << fullState.drain_deadline_ms
+                << " ms passed\n";
+    }
+
+    assert(drain_count == 1);
+    assert(fullState.draining);
+    assert(fullState.drain_timed_out);
+    assert(fullState.drain_deadline_ms == 50);
+  }
+
+  if (trace) {
+    // Whole trace is written before terminate
+    simple::NewHandler::FullState fullState =
+        simple::NewHandler::GetFullState();
+    struct stat st;
+
+    assert(stat(trace_path, &st) == 0);
+    assert(static_cast<size_t>(st.st_size) ==
+           sizeof(simple::NewHandler::TraceHeader) +
+               fullState.trace_record_count *
+                   sizeof(simple::NewHandler::TraceRecord));
+    assert(fullState.trace_record_count >= alloc_count);
+  }
+
+  if (domains) {
+    // Leaking domain has been notified
+    simple::NewHandler::FullState fullState =
+        simple::NewHandler::GetFullState();
+
+    assert(pressure_count > 0);
+    assert(fullState.pressure_domain == 1);
+    assert(fullState.domains[1].pressure_count == pressure_count);
+    assert(fullState.domains[1].bytes >= 50 * MB);
+    assert(fullState.domains[2].pressure_count == 0);
+  }
   if (debug) {
     std::cout << "Terminated at " << (alloc_count + 1) << " MB\n";
   }
@@ -63,15 +495,272 @@ static void SignalHandler(int signo) {
   have_signal = true;
 }
 
+static void RevokeCallback(void* context, void* data, size_t size) {
+  simple::ReserveLease* lease = static_cast<simple::ReserveLease*>(context);
+
+  // Lent blocks are reclaimed only after idle ones
+  assert(simple::NewHandler::GetState().available_block_count <= lent_count);
+  assert(lease->data() == nullptr);
+  assert(size == 10 * MB || partial);
+
+  // Lent memory is still accessible
+  static_cast<char*>(data)[size - 1] = 'r';
+
+  revoked_count++;
+}
+
+// Feed fake statm samples growing by 100 pages a minute and check
+// time-to-exhaustion estimate against 1000 pages limit
+//
+static void TestEstimator() {
+  char const* path = "test_statm.tmp";
+  size_t const page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+  simple::NewHandler::SetExhaustionEstimator(600, 1000 * page, false, path);
+
+  for (size_t ii = 1; ii <= 3; ii++) {
+    std::ofstream statm(path);
+    statm << (ii * 100) << " 10 5 1 0 50 0\n";
+    statm.close();
+
+    simple::NewHandler::SampleUsage(ii * 60000);
+  }
+
+  std::remove(path);
+
+  simple::NewHandler::FullState fullState = simple::NewHandler::GetFullState();
+
+  if (debug) {
+    std::cout << "Estimated exhaustion in "
+              << fullState.exhaustion_estimate_sec << " seconds\n";
+  }
+
+  // 700 pages left at 100 pages a minute
+  assert(fullState.usage_limit == 1000 * page);
+  assert(fullState.usage_bytes == 300 * page);
+  assert(fullState.exhaustion_estimate_sec >= 419);
+  assert(fullState.exhaustion_estimate_sec <= 420);
+  assert(fullState.exhaustion_alert_count == 1);
+
+  if (signo != 0) {
+    assert(have_signal);
+    have_signal = false;
+  }
+}
+
+static void DomainPressure(unsigned int domain, void* context) {
+  assert(domain == 1);
+  assert(context == &pressure_count);
+
+  if (debug) {
+    std::cout << "Domain " << domain << " is over its budget\n";
+  }
+
+  pressure_count++;
+}
+
+static void DrillPressure(unsigned int domain, void* context) {
+  assert(domain == 3);
+  ++*static_cast<size_t*>(context);
+}
+
+// Run a pressure drill, the reserve must stay intact
+//
+static void TestDrill() {
+  simple::NewHandler::State before = simple::NewHandler::GetState();
+
+  // Domain over its cap gets the callback but no pressure is recorded
+  size_t drill_pressure = 0;
+  char* charged = nullptr;
+
+  if (domains) {
+    simple::NewHandler::SetDomain(3, "drill", 1, DrillPressure,
+                                  &drill_pressure);
+
+    simple::DomainScope scope(3);
+    charged = new char[1024];
+  }
+
+  uint64_t latency = simple::NewHandler::SimulatePressure(3);
+
+  if (domains) {
+    simple::NewHandler::FullState fullState =
+        simple::NewHandler::GetFullState();
+
+    delete[] charged;
+
+    assert(drill_pressure == 3);
+    assert(fullState.domains[3].pressure_count == 0);
+    assert(fullState.pressure_domain == -1);
+  }
+
+  simple::NewHandler::AckPressure();
+
+  simple::NewHandler::FullState fullState = simple::NewHandler::GetFullState();
+
+  if (debug) {
+    std::cout << "Drill took " << latency << " ns, reaction "
+              << fullState.reaction_latency_ns << " ns\n";
+  }
+
+  assert(!fullState.drill_active);
+  assert(fullState.drill_count == 1);
+  assert(fullState.drill_latency_ns == latency);
+  assert(fullState.reaction_latency_ns >= latency);
+  assert(fullState.state.available_block_count ==
+         before.available_block_count);
+
+  if (signo != 0) {
+    assert(have_signal);
+    have_signal = false;
+  }
+}
+
+// Load plugin with its own copy of the handler, it must bind
+// to the reserve of this program
+//
+static void TestPlugin() {
+  void* plugin = dlopen("./test_plugin.so", RTLD_NOW | RTLD_LOCAL);
+
+  if (!plugin) {
+    std::cout << "cannot load plugin: " << dlerror() << "\n";
+    assert(false);
+    return;
+  }
+
+  auto fn = reinterpret_cast<int (*)(size_t, size_t)>(
+      dlsym(plugin, "TestPlugin"));
+  assert(fn != nullptr);
+
+  simple::NewHandler::FullState fullState = simple::NewHandler::GetFullState();
+
+  int res = fn(fullState.reserved_block_count,
+               fullState.state.available_block_count);
+
+  if (debug) {
+    std::cout << "Plugin returned " << res << "\n";
+  }
+
+  assert(res == 0);
+  assert(simple::NewHandler::GetFullState().drill_count ==
+         fullState.drill_count + 1);
+
+  if (signo != 0) {
+    assert(have_signal);
+    have_signal = false;
+  }
+}
+
+static void InitDone(simple::NewHandler::State state, void* context) {
+  assert(context == &init_done);
+  assert(state.allocated_block_count <= 10);
+  assert(state.available_block_count == state.allocated_block_count);
+
+  init_done = true;
+}
+
+// Fake topology: node 0 has all CPUs, node 1 has memory only
+//
+static void MakeNumaTopology(char const* root) {
+  std::string node0 = std::string(root) + "/node0";
+  std::string node1 = std::string(root) + "/node1";
+
+  mkdir(root, 0755);
+  mkdir(node0.c_str(), 0755);
+  mkdir(node1.c_str(), 0755);
+
+  std::ofstream(node0 + "/cpulist") << "0-1023\n";
+  std::ofstream(node1 + "/cpulist") << "\n";
+}
+
 static void usage() {
   std::cout << "usage: test_simple_new__handler [--debug][--signal] [--chain] "
+               "[--critical] [--mmap] [--report] [--lend] [--estimator] "
+               "[--domains] [--drill] [--plugin] [--async] [--partial] "
+               "[--numa] [--journal] [--profile] [--trim] [--trace] [--malloc] "
+               "[--coordinator] [--drain] [--exit] "
                "[memory-limit-in-mbs]\n";
   std::cout << "\n";
 }
 
+// Wait until the coordinator answered the first pressure report
+//
+static void WaitForCoordinator() {
+  for (int ii = 0; ii < 5000; ii++) {
+    if (simple::NewHandler::GetFullState().coordinator_release_count) {
+      return;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  assert(false);
+}
+
+// malloc() fails only when the shim has released the whole reserve
+//
+static void MallocFailed() {
+  simple::NewHandler::State state = simple::NewHandler::GetState();
+
+  if (debug) {
+    std::cout << "malloc failed at " << (alloc_count + 1) << " MB\n";
+  }
+
+  assert(state.allocated_block_count > 0);
+  assert(state.available_block_count == 0);
+
+  exit(0);
+}
+
+// Leak memory 1MB at a time tracking reserved block releases
+//
+static void Leak(size_t* avail) {
+  for (; alloc_count < 10000000; alloc_count++) {
+    char* p = leak_malloc ? static_cast<char*>(malloc(1024 * 1024))
+                          : new char[1024 * 1024];
+
+    if (!p) {
+      MallocFailed();
+    }
+
+    *p = 'a';  // Map allocated block
+
+    if (debug) {
+      std::cout << "Allocated " << (alloc_count + 1) << " MB\n";
+    }
+
+    simple::NewHandler::State state = simple::NewHandler::GetState();
+
+    if (state.available_block_count < *avail) {
+      if (debug) {
+        std::cout << "Block " << (state.allocated_block_count - *avail)
+                  << " released at " << (alloc_count + 1) << " MB\n";
+
+        // We should get a signal if configured
+        if (signo != 0) {
+          assert(have_signal);
+          have_signal = false;
+        }
+      }
+      *avail = state.available_block_count;
+
+      if (coordinator) {
+        WaitForCoordinator();
+        *avail = simple::NewHandler::GetState().available_block_count;
+      }
+    }
+  }
+}
+
 int main(int argc, char** argv) {
   size_t limit = 200;
-  int signo = 0;
+  size_t const watermark = 3;
+  bool use_mmap = false;
+  bool lend = false;
+  bool estimator = false;
+  bool drill = false;
+  bool plugin = false;
+  bool async = false;
 
 #if __APPLE__
   // We cannot run this test on macos because it ignores
@@ -85,10 +774,29 @@ int main(int argc, char** argv) {
                                          {"debug", no_argument, 0, 2},
                                          {"help", no_argument, 0, 3},
                                          {"signal", no_argument, 0, 4},
+                                         {"critical", no_argument, 0, 5},
+                                         {"mmap", no_argument, 0, 6},
+                                         {"report", no_argument, 0, 7},
+                                         {"lend", no_argument, 0, 8},
+                                         {"estimator", no_argument, 0, 9},
+                                         {"domains", no_argument, 0, 10},
+                                         {"drill", no_argument, 0, 11},
+                                         {"plugin", no_argument, 0, 12},
+                                         {"async", no_argument, 0, 13},
+                                         {"partial", no_argument, 0, 14},
+                                         {"numa", no_argument, 0, 15},
+                                         {"journal", no_argument, 0, 16},
+                                         {"profile", no_argument, 0, 17},
+                                         {"trim", no_argument, 0, 18},
+                                         {"trace", no_argument, 0, 19},
+                                         {"malloc", no_argument, 0, 20},
+                                         {"coordinator", no_argument, 0, 21},
+                                         {"drain", no_argument, 0, 22},
+                                         {"exit", no_argument, 0, 23},
                                          {0, 0, 0, 0}};
 
   for (;;) {
-    int c = getopt_long(argc, argv, "cdhs", long_options, 0);
+    int c = getopt_long(argc, argv, "cdhspmrleoiuatnjfgkyxzw", long_options, 0);
 
     if (c < 0) {
       break;
@@ -115,6 +823,102 @@ int main(int argc, char** argv) {
         signo = SIGUSR1;
         break;
 
+      case 5:
+      case 'p':
+        critical = true;
+        break;
+
+      case 6:
+      case 'm':
+        use_mmap = true;
+        break;
+
+      case 7:
+      case 'r':
+        report = true;
+        break;
+
+      case 8:
+      case 'l':
+        lend = true;
+        break;
+
+      case 9:
+      case 'e':
+        estimator = true;
+        break;
+
+      case 10:
+      case 'o':
+        domains = true;
+        break;
+
+      case 11:
+      case 'i':
+        drill = true;
+        break;
+
+      case 12:
+      case 'u':
+        plugin = true;
+        break;
+
+      case 13:
+      case 'a':
+        async = true;
+        break;
+
+      case 14:
+      case 't':
+        partial = true;
+        use_mmap = true;
+        break;
+
+      case 15:
+      case 'n':
+        numa = true;
+        break;
+
+      case 16:
+      case 'j':
+        journal = true;
+        break;
+
+      case 17:
+      case 'f':
+        profile = true;
+        break;
+
+      case 18:
+      case 'g':
+        trim = true;
+        break;
+
+      case 19:
+      case 'k':
+        trace = true;
+        break;
+
+      case 20:
+      case 'y':
+        leak_malloc = true;
+        break;
+
+      case 21:
+      case 'x':
+        coordinator = true;
+        break;
+
+      case 22:
+      case 'z':
+        drain = true;
+        break;
+
+      case 23:
+      case 'w':
+        normal_exit = true;
+        break;
+
       default:
         usage();
         return 1;
@@ -140,6 +944,13 @@ int main(int argc, char** argv) {
     limit = tmp;
   }
 
+#ifndef SIMPLE_NEW_HANDLER_DEFINE_OPERATORS
+  if (domains || profile || trace) {
+    std::cout << "domains, profile and trace require replacement operators\n";
+    return 1;
+  }
+#endif
+
   if (debug) {
     std::cout << "Memory limit: " << limit << "MB\n";
   }
@@ -162,15 +973,138 @@ int main(int argc, char** argv) {
   assert(fullState.reserved_block_count == 0);
   assert(fullState.state.allocated_block_count == 0);
   assert(fullState.state.available_block_count == 0);
+  assert(fullState.reserve_mode == simple::NewHandler::ReserveMode::kHeap);
+  assert(fullState.critical_watermark == 0);
+  assert(fullState.report_fd == -1);
+  assert(fullState.exhaustion_estimate_sec ==
+         simple::NewHandler::kNoEstimate);
 
   if (do_chain) {
     std::set_new_handler(ChainedHandler);
   }
 
+  if (use_mmap) {
+    simple::NewHandler::SetReserveMode(simple::NewHandler::ReserveMode::kMmap);
+  }
+
+  if (numa) {
+    MakeNumaTopology("test_numa");
+    simple::NewHandler::SetNumaReserve("test_numa");
+
+    fullState = simple::NewHandler::GetFullState();
+    assert(fullState.numa_node_count == 2);
+    assert(fullState.reserve_mode == simple::NewHandler::ReserveMode::kMmap);
+  }
+
+  if (partial) {
+    // Release 10MB blocks in 2MB steps
+    bool set = simple::NewHandler::SetPartialRelease(2 * MB);
+    assert(set);
+    assert(simple::NewHandler::GetFullState().partial_release_step == 2 * MB);
+  }
+
+  if (journal) {
+    bool mapped = simple::NewHandler::SetJournal(journal_path, 256);
+    assert(mapped);
+    assert(simple::NewHandler::GetFullState().journal_capacity == 256);
+  }
+
+  if (profile) {
+    // Sample every 256KB on average, dump on every block release
+    int fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    bool enabled = simple::NewHandler::SetHeapProfile(256 * 1024, fd);
+    assert(enabled);
+    assert(simple::NewHandler::GetFullState().heap_profile_period ==
+           256 * 1024);
+
+    TestProfileChurn();
+  }
+
+  if (trim) {
+    // Memory held by the fake allocator cache
+    trim_cache = malloc(20 * MB);
+    assert(trim_cache);
+    memset(trim_cache, 't', 20 * MB);
+
+    simple::NewHandler::SetTrim(100);
+    assert(simple::NewHandler::GetFullState().trim_window_ms == 100);
+  }
+
+  if (coordinator) {
+    // Registration is sent at Init()
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, coordinator_path, sizeof(addr.sun_path) - 1);
+    unlink(coordinator_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(listen_fd >= 0);
+    res = bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    assert(res == 0);
+    res = listen(listen_fd, 1);
+    assert(res == 0);
+
+    std::thread(CoordinatorStandIn, listen_fd).detach();
+
+    bool connected = simple::NewHandler::ConnectCoordinator(
+        coordinator_path, 5, Shed, &shed_count);
+    assert(connected);
+  }
+
+  if (drain) {
+    // Watchdog thread is started here
+    bool set = simple::NewHandler::SetDrainHook(Drain, 50, &drain_count);
+    assert(set);
+    assert(!simple::NewHandler::SetDrainHook(Drain, 50, &drain_count));
+  }
+
+  if (trace) {
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    simple::NewHandler::SetTrace(fd);
+  }
+
   // Init with 10 spare chunks
   // 10 MB each cnhunk
   // and 1K reserve
-  simple::NewHandler::Init(1024, 10, 10 * MB, signo, do_chain);
+  if (async) {
+    // Handler and final block are ready right away, wait for
+    // the reserve built in the background
+    bool started = simple::NewHandler::InitAsync(1024, 10, 10 * MB, signo,
+                                                 do_chain, InitDone, &init_done);
+    assert(started);
+
+    fullState = simple::NewHandler::GetFullState();
+    assert(fullState.init_done);
+    assert(fullState.final_block_allocated);
+
+    while (!init_done) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    assert(!simple::NewHandler::GetFullState().reserve_pending);
+  } else {
+    simple::NewHandler::Init(1024, 10, 10 * MB, signo, do_chain);
+  }
+
+  if (critical) {
+    simple::NewHandler::SetCriticalWatermark(watermark);
+  }
+
+  while (coordinator && !registered) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  if (report) {
+    int fd = open(report_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    simple::NewHandler::SetReportFd(fd);
+    assert(simple::NewHandler::GetFullState().report_fd == fd);
+  }
 
   // Set terminate handler to print reached allocation level
   std::set_terminate(TerminateHandler);
@@ -184,6 +1118,9 @@ int main(int argc, char** argv) {
   assert(fullState.final_block_allocated);
   assert(fullState.reserved_block_size == 10 * MB);
   assert(fullState.reserved_block_count == 10);
+  assert(fullState.reserve_mode ==
+         (use_mmap || numa ? simple::NewHandler::ReserveMode::kMmap
+                           : simple::NewHandler::ReserveMode::kHeap));
   assert(fullState.state.allocated_block_count <= 10);
   assert(fullState.state.available_block_count ==
          fullState.state.allocated_block_count);
@@ -197,30 +1134,112 @@ int main(int argc, char** argv) {
 
   size_t avail = state.available_block_count;
 
-  try {
-    for (alloc_count = 0; alloc_count < 10000000; alloc_count++) {
-      char* p = new char[1024 * 1024];
-      *p = 'a'; // Map allocated block
+  if (estimator) {
+    TestEstimator();
+  }
 
-      if (debug) {
-        std::cout << "Allocated " << (alloc_count + 1) << " MB\n";
+  if (drill) {
+    TestDrill();
+  }
+
+  if (plugin) {
+    TestPlugin();
+  }
+
+  // Lend some blocks as a cache
+  simple::ReserveLease leases[lend_count];
+
+  if (lend) {
+    if (partial) {
+      // First lease gets a partially released block
+      bool released = simple::NewHandler::ReleaseReserve();
+      assert(released);
+      assert(simple::NewHandler::GetFullState().partial_block_count == 1);
+    }
+
+    for (auto& lease : leases) {
+      if (!simple::NewHandler::LendBlock(&lease, RevokeCallback, &lease)) {
+        break;
       }
 
-      simple::NewHandler::State state = simple::NewHandler::GetState();
+      assert(lease.data() != nullptr);
+      assert(lease.size() == 10 * MB || (partial && &lease == leases));
+      memset(lease.data(), 'c', lease.size());
 
-      if (state.available_block_count < avail) {
-        if (debug) {
-          std::cout << "Block " << (state.allocated_block_count - avail)
-                    << " released at " << (alloc_count + 1) << " MB\n";
+      lent_count++;
+    }
 
-          // We should get a signal if configured
-          if (signo != 0) {
-            assert(have_signal);
-            have_signal = false;
-          }
-        }
-        avail = state.available_block_count;
+    // Returned block is idle again
+    if (lent_count) {
+      leases[0].Return();
+      assert(leases[0].data() == nullptr);
+
+      bool relent =
+          simple::NewHandler::LendBlock(&leases[0], RevokeCallback, &leases[0]);
+      assert(relent);
+    }
+
+    fullState = simple::NewHandler::GetFullState();
+
+    assert(fullState.lent_block_count == lent_count);
+    assert(fullState.state.available_block_count == avail);
+
+    if (debug) {
+      std::cout << "Lent " << lent_count << " blocks\n";
+    }
+  }
+
+  if (domains && !drill) {
+    // Nothing is charged before the first domain is set
+    assert(simple::NewHandler::GetFullState().domains[0].bytes == 0);
+  }
+
+  if (domains) {
+    // Leak is charged to domain 1, it goes over its soft cap,
+    // idle domain 2 does not
+    simple::NewHandler::SetDomain(1, "leak", 50 * MB, DomainPressure,
+                                  &pressure_count);
+    simple::NewHandler::SetDomain(2, "idle", 1 * MB, DomainPressure,
+                                  &pressure_count);
+  }
+
+  if (normal_exit) {
+    // Process that never runs out of memory exits as usual
+    std::cout << "Exited normally\n";
+    return 0;
+  }
+
+  simple::DomainScope domain_scope(domains ? 1 : 0);
+
+  if (critical) {
+    // Best-effort allocations must fail once the watermark is reached
+    try {
+      Leak(&avail);
+      assert(false);
+      return 1;
+    } catch (std::bad_alloc& e) {
+      fullState = simple::NewHandler::GetFullState();
+
+      if (debug) {
+        std::cout << "Best-effort allocation failed at " << (alloc_count + 1)
+                  << " MB\n";
       }
+
+      assert(fullState.critical_watermark == watermark);
+      assert(fullState.best_effort_rejected_count == 1);
+      assert(fullState.critical_released_block_count == 0);
+      assert(fullState.state.available_block_count ==
+             std::min(watermark, fullState.state.allocated_block_count));
+    }
+  }
+
+  try {
+    if (critical) {
+      // Critical allocations consume the rest of the reserve
+      simple::CriticalScope scope;
+      Leak(&avail);
+    } else {
+      Leak(&avail);
     }
   } catch (std::bad_alloc& e) {
     // Should not be here
@@ -0,0 +1,223 @@
+// Copyright (C) 2020  Aleksey Romanov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Local coordinator: arbitrate reserve release across worker processes
+// connected with NewHandler::ConnectCoordinator()
+//
+// When a worker releases a reserved block on a failure, the least
+// important other worker, with priority not above the reporting one,
+// is asked to shed memory and to release a reserved block if it has
+// one. The reporting worker does not wait for this, its own block is
+// already released: the peer's block is extra shedding, so a failure
+// drains two blocks of the host, and less important workers give up
+// memory along with the failing one rather than before it.
+//
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Connected worker and its last reported state
+//
+struct Worker {
+  int fd = -1;
+  long pid = 0;
+  unsigned int priority = 0;
+  size_t allocated = 0;
+  size_t available = 0;
+  std::string input;
+};
+
+static void Send(const Worker& worker, const char* command) {
+  std::string line = std::string(command) + "\n";
+
+  if (send(worker.fd, line.data(), line.size(), MSG_NOSIGNAL) < 0) {
+    std::cout << "worker " << worker.pid << ": send failed\n";
+  }
+}
+
+// Pressure in 'from': pick the victim to shed and release first
+static void Arbitrate(std::vector<Worker>& workers, const Worker& from) {
+  Worker* victim = nullptr;
+
+  for (auto& worker : workers) {
+    if (&worker == &from || worker.pid == 0 ||
+        worker.priority > from.priority) {
+      continue;
+    }
+
+    if (!victim || worker.priority < victim->priority ||
+        (worker.priority == victim->priority &&
+         worker.available > victim->available)) {
+      victim = &worker;
+    }
+  }
+
+  if (!victim) {
+    std::cout << "worker " << from.pid
+              << ": pressure, no less important worker\n";
+    return;
+  }
+
+  std::cout << "worker " << from.pid << ": pressure, shed worker "
+            << victim->pid;
+
+  Send(*victim, "SHED");
+
+  if (victim->available > 0) {
+    std::cout << ", release its block";
+
+    Send(*victim, "RELEASE");
+
+    // Until it reports back
+    victim->available--;
+  }
+
+  std::cout << "\n";
+}
+
+// <verb> <pid> <priority> <allocated> <available>
+static void Message(std::vector<Worker>& workers, Worker& worker,
+                    const std::string& line) {
+  char verb[32];
+  long pid = 0;
+  unsigned int priority = 0;
+  size_t allocated = 0;
+  size_t available = 0;
+
+  if (sscanf(line.c_str(), "%31s %ld %u %zu %zu", verb, &pid, &priority,
+             &allocated, &available) != 5) {
+    std::cout << "bad message: " << line << "\n";
+    return;
+  }
+
+  worker.pid = pid;
+  worker.priority = priority;
+  worker.allocated = allocated;
+  worker.available = available;
+
+  std::cout << "worker " << pid << ": " << verb << " priority " << priority
+            << " blocks " << available << "/" << allocated << "\n";
+
+  if (strcmp(verb, "PRESSURE") == 0 || strcmp(verb, "EXHAUSTED") == 0) {
+    Arbitrate(workers, worker);
+  }
+}
+
+static void usage() {
+  std::cout << "usage: coordinator socket-path\n";
+  std::cout << "\n";
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    usage();
+    return 1;
+  }
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+    std::cout << "socket path is too long\n";
+    return 1;
+  }
+
+  strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+  unlink(argv[1]);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (listen_fd < 0 ||
+      bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(listen_fd, 64) != 0) {
+    perror("coordinator");
+    return 1;
+  }
+
+  std::vector<Worker> workers;
+
+  for (;;) {
+    std::vector<pollfd> fds(1 + workers.size());
+
+    fds[0] = {listen_fd, POLLIN, 0};
+
+    for (size_t ii = 0; ii < workers.size(); ii++) {
+      fds[ii + 1] = {workers[ii].fd, POLLIN, 0};
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      continue;
+    }
+
+    // Gone workers are removed after the pass
+    std::vector<size_t> gone;
+
+    for (size_t ii = 0; ii < workers.size(); ii++) {
+      if (!fds[ii + 1].revents) {
+        continue;
+      }
+
+      char buf[256];
+      ssize_t res = read(workers[ii].fd, buf, sizeof(buf));
+
+      if (res <= 0) {
+        std::cout << "worker " << workers[ii].pid << ": gone\n";
+        gone.push_back(ii);
+        continue;
+      }
+
+      Worker& worker = workers[ii];
+
+      worker.input.append(buf, static_cast<size_t>(res));
+
+      size_t eol;
+
+      while ((eol = worker.input.find('\n')) != std::string::npos) {
+        std::string line = worker.input.substr(0, eol);
+
+        worker.input.erase(0, eol + 1);
+        Message(workers, worker, line);
+      }
+    }
+
+    for (size_t ii = gone.size(); ii > 0; ii--) {
+      close(workers[gone[ii - 1]].fd);
+      workers.erase(workers.begin() + gone[ii - 1]);
+    }
+
+    if (fds[0].revents) {
+      int fd = accept(listen_fd, nullptr, nullptr);
+
+      if (fd >= 0) {
+        Worker worker;
+        worker.fd = fd;
+        workers.push_back(worker);
+      }
+    }
+  }
+}
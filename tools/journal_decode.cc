@@ -0,0 +1,189 @@
+// Copyright (C) 2020  Aleksey Romanov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Journal decoder: print records of a handler journal in order
+// and summarize how fast the reserve drained
+//
+
+#include <simple_new_handler.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+using Handler = simple::NewHandler;
+using Event = Handler::JournalEvent;
+
+static char const* EventName(uint32_t event) {
+  switch (static_cast<Event>(event)) {
+    case Event::kInit:
+      return "init";
+    case Event::kRelease:
+      return "release";
+    case Event::kPartialRelease:
+      return "partial_release";
+    case Event::kRevoke:
+      return "revoke";
+    case Event::kReject:
+      return "reject";
+    case Event::kExhausted:
+      return "exhausted";
+    case Event::kDrill:
+      return "drill";
+    case Event::kExhaustionAlert:
+      return "exhaustion_alert";
+    case Event::kDomainPressure:
+      return "domain_pressure";
+    case Event::kSnapshot:
+      return "snapshot";
+    case Event::kTrim:
+      return "trim";
+    case Event::kDrain:
+      return "drain";
+    case Event::kDrainTimeout:
+      return "drain_timeout";
+  }
+
+  return "unknown";
+}
+
+// Seconds with nanoseconds
+static void PrintTime(uint64_t time_ns) {
+  std::cout << time_ns / 1000000000 << "." << std::setw(9) << std::setfill('0')
+            << time_ns % 1000000000 << std::setfill(' ');
+}
+
+static void usage() {
+  std::cout << "usage: journal_decode journal-file\n";
+  std::cout << "\n";
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    usage();
+    return 1;
+  }
+
+  std::ifstream file(argv[1], std::ios::binary);
+
+  Handler::JournalHeader header;
+
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    std::cout << argv[1] << ": cannot read header\n";
+    return 1;
+  }
+
+  if (memcmp(header.magic, Handler::kJournalMagic, sizeof(header.magic)) !=
+          0 ||
+      header.version != Handler::kJournalVersion ||
+      header.record_size != sizeof(Handler::JournalRecord)) {
+    std::cout << argv[1] << ": not a journal of this version\n";
+    return 1;
+  }
+
+  std::vector<Handler::JournalRecord> records;
+
+  for (uint64_t ii = 0; ii < header.capacity; ii++) {
+    Handler::JournalRecord record;
+
+    if (!file.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+      break;
+    }
+
+    // Never written or torn by the process death
+    if (record.seq != 0) {
+      records.push_back(record);
+    }
+  }
+
+  std::sort(records.begin(), records.end(),
+            [](const Handler::JournalRecord& a,
+               const Handler::JournalRecord& b) { return a.seq < b.seq; });
+
+  std::cout << "pid: " << header.pid << "\n";
+  std::cout << "start_time: ";
+  PrintTime(header.start_time_ns);
+  std::cout << "\n";
+  std::cout << "reserved_block_size: " << header.reserved_block_size << "\n";
+  std::cout << "reserved_block_count: " << header.reserved_block_count << "\n";
+  std::cout << "capacity: " << header.capacity << "\n";
+  std::cout << "records: " << records.size() << "\n";
+
+  if (!records.empty() && records.front().seq > 1) {
+    std::cout << "overwritten: " << records.front().seq - 1 << "\n";
+  }
+
+  std::cout << "\n";
+
+  // seq time event arg available/allocated value extra
+  uint64_t first_release_ns = 0;
+  uint64_t last_release_ns = 0;
+  size_t release_count = 0;
+
+  for (const auto& record : records) {
+    std::cout << std::setw(8) << record.seq << " ";
+    PrintTime(record.time_ns);
+    std::cout << " " << std::left << std::setw(16) << EventName(record.event)
+              << std::right << " avail " << record.available << "/"
+              << record.allocated << " arg " << record.arg << " value "
+              << record.value;
+
+    if (record.event == static_cast<uint32_t>(Event::kSnapshot)) {
+      std::cout << " estimate ";
+
+      if (record.extra == Handler::kNoEstimate) {
+        std::cout << "-";
+      } else {
+        std::cout << record.extra;
+      }
+    }
+
+    std::cout << "\n";
+
+    if (record.event == static_cast<uint32_t>(Event::kRelease) ||
+        record.event == static_cast<uint32_t>(Event::kRevoke)) {
+      if (!release_count) {
+        first_release_ns = record.time_ns;
+      }
+
+      last_release_ns = record.time_ns;
+      release_count++;
+    }
+  }
+
+  std::cout << "\n";
+  std::cout << "released_blocks: " << release_count << "\n";
+
+  if (release_count > 1) {
+    double span = static_cast<double>(last_release_ns - first_release_ns) / 1e9;
+
+    std::cout << "drain_time_sec: " << span << "\n";
+
+    if (span > 0) {
+      std::cout << "drain_rate_blocks_per_sec: " << (release_count - 1) / span
+                << "\n";
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,370 @@
+// Copyright (C) 2020  Aleksey Romanov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Reserve simulator: replay an allocation trace against a model of the
+// handler release logic under a memory limit, for several reserve
+// configurations at once
+//
+// The model counts requested bytes only: a failure happens when the
+// base usage, live allocations, the reserve and the final block do not
+// fit into the limit. Freed memory is assumed to be reusable, as it is
+// in kMmap mode.
+//
+
+#include <getopt.h>
+#include <simple_new_handler.h>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using Handler = simple::NewHandler;
+
+static size_t const MB = 1024 * 1024;
+static size_t const kPage = 4096;
+
+// One reserve configuration and its simulated state
+//
+struct Sim {
+  std::string name;
+  size_t final_block_size = 0;
+  size_t block_count = 0;
+  size_t block_size = 0;
+  size_t step = 0;
+
+  // Bytes left of every block, the first non-empty one is released
+  std::vector<size_t> left;
+  size_t current = 0;
+  size_t held = 0;
+
+  std::vector<size_t> absorbed;
+  std::vector<uint64_t> released_ns;
+  size_t failures = 0;
+  bool terminated = false;
+  uint64_t terminated_ns = 0;
+};
+
+// Number with optional K, M or G suffix
+static bool ParseSize(const char* text, size_t* value) {
+  char* end = nullptr;
+  size_t res = strtoul(text, &end, 0);
+
+  if (end == text) {
+    return false;
+  }
+
+  switch (*end) {
+    case 'K':
+    case 'k':
+      res *= 1024;
+      end++;
+      break;
+    case 'M':
+    case 'm':
+      res *= MB;
+      end++;
+      break;
+    case 'G':
+    case 'g':
+      res *= 1024 * MB;
+      end++;
+      break;
+  }
+
+  if (*end != 0) {
+    return false;
+  }
+
+  *value = res;
+  return true;
+}
+
+// count:size[:step[:final]]
+static bool ParseConfig(const char* text, Sim* sim) {
+  std::string spec(text);
+  std::vector<std::string> fields;
+  size_t pos = 0;
+
+  for (;;) {
+    size_t next = spec.find(':', pos);
+
+    fields.push_back(spec.substr(pos, next - pos));
+
+    if (next == std::string::npos) {
+      break;
+    }
+
+    pos = next + 1;
+  }
+
+  if (fields.size() < 2 || fields.size() > 4) {
+    return false;
+  }
+
+  size_t* values[] = {&sim->block_count, &sim->block_size, &sim->step,
+                      &sim->final_block_size};
+
+  for (size_t ii = 0; ii < fields.size(); ii++) {
+    if (!ParseSize(fields[ii].c_str(), values[ii])) {
+      return false;
+    }
+  }
+
+  sim->name = spec;
+  sim->left.assign(sim->block_count, sim->block_size);
+  sim->absorbed.assign(sim->block_count, 0);
+  sim->released_ns.assign(sim->block_count, 0);
+  sim->held = sim->block_count * sim->block_size + sim->final_block_size;
+
+  return true;
+}
+
+// Release logic of Process(): the tail of the first block in steps
+// large enough for the request or the whole block, false when the
+// reserve is empty
+static bool Release(Sim* sim, size_t size, uint64_t time_ns) {
+  if (sim->current == sim->block_count) {
+    return false;
+  }
+
+  size_t& left = sim->left[sim->current];
+  size_t amount = left;
+  size_t step = sim->step;
+
+  if (step != 0) {
+    size_t request = (size + 2 * kPage - 1) / kPage * kPage;
+
+    if (request > step) step = request;
+
+    if (left > step + kPage) {
+      amount = step;
+    }
+  }
+
+  left -= amount;
+  sim->held -= amount;
+  sim->absorbed[sim->current]++;
+
+  if (left == 0) {
+    sim->released_ns[sim->current] = time_ns;
+    sim->current++;
+  }
+
+  return true;
+}
+
+static void Allocate(Sim* sim, size_t base, size_t live, size_t size,
+                     size_t limit, uint64_t time_ns) {
+  while (base + live + size + sim->held > limit) {
+    sim->failures++;
+
+    if (!Release(sim, size, time_ns)) {
+      sim->terminated = true;
+      sim->terminated_ns = time_ns;
+      return;
+    }
+  }
+}
+
+static void PrintTime(uint64_t time_ns) {
+  std::cout << static_cast<double>(time_ns) / 1e9 << "s";
+}
+
+static void Report(const Sim& sim) {
+  std::cout << "config " << sim.name << ": " << sim.block_count << " x "
+            << sim.block_size << " bytes";
+
+  if (sim.step) {
+    std::cout << ", step " << sim.step;
+  }
+
+  std::cout << ", final " << sim.final_block_size << "\n";
+
+  for (size_t ii = 0; ii < sim.block_count; ii++) {
+    if (!sim.absorbed[ii]) {
+      break;
+    }
+
+    std::cout << "  block " << ii << ": absorbed " << sim.absorbed[ii]
+              << " failures";
+
+    if (sim.left[ii] == 0) {
+      std::cout << ", drained at ";
+      PrintTime(sim.released_ns[ii]);
+    }
+
+    std::cout << "\n";
+  }
+
+  std::cout << "  failures: " << sim.failures << "\n";
+
+  if (sim.current == sim.block_count && sim.block_count) {
+    std::cout << "  reserve drained at ";
+    PrintTime(sim.released_ns[sim.block_count - 1]);
+    std::cout << "\n";
+  } else {
+    std::cout << "  reserve not drained, " << sim.block_count - sim.current
+              << " blocks left\n";
+  }
+
+  if (sim.terminated) {
+    std::cout << "  terminated at ";
+    PrintTime(sim.terminated_ns);
+    std::cout << "\n";
+  }
+}
+
+static void usage() {
+  std::cout << "usage: reserve_sim --limit size [--base size] "
+               "--config count:size[:step[:final]] [--config ...] "
+               "trace-file\n";
+  std::cout << "\n";
+  std::cout << "Sizes take K, M or G suffix, e.g. --config 10:10M:2M\n";
+  std::cout << "\n";
+}
+
+int main(int argc, char** argv) {
+  size_t limit = 0;
+  size_t base = 0;
+  std::vector<Sim> sims;
+
+  static struct option long_options[] = {{"limit", required_argument, 0, 1},
+                                         {"base", required_argument, 0, 2},
+                                         {"config", required_argument, 0, 3},
+                                         {"help", no_argument, 0, 4},
+                                         {0, 0, 0, 0}};
+
+  for (;;) {
+    int c = getopt_long(argc, argv, "l:b:c:h", long_options, 0);
+
+    if (c < 0) {
+      break;
+    }
+
+    switch (c) {
+      case 1:
+      case 'l':
+        if (!ParseSize(optarg, &limit)) {
+          std::cout << "bad limit\n";
+          return 1;
+        }
+        break;
+
+      case 2:
+      case 'b':
+        if (!ParseSize(optarg, &base)) {
+          std::cout << "bad base\n";
+          return 1;
+        }
+        break;
+
+      case 3:
+      case 'c': {
+        Sim sim;
+
+        if (!ParseConfig(optarg, &sim)) {
+          std::cout << "bad config " << optarg << "\n";
+          return 1;
+        }
+
+        sims.push_back(sim);
+        break;
+      }
+
+      case 4:
+      case 'h':
+        usage();
+        return 0;
+
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (optind + 1 != argc || limit == 0 || sims.empty()) {
+    usage();
+    return 1;
+  }
+
+  std::ifstream file(argv[optind], std::ios::binary);
+  Handler::TraceHeader header;
+
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      memcmp(header.magic, Handler::kTraceMagic, sizeof(header.magic)) != 0 ||
+      header.version != Handler::kTraceVersion ||
+      header.record_size != sizeof(Handler::TraceRecord)) {
+    std::cout << argv[optind] << ": not a trace of this version\n";
+    return 1;
+  }
+
+  // Replay, times are relative to the first record
+  Handler::TraceRecord record;
+  uint64_t start_ns = 0;
+  uint64_t time_ns = 0;
+  size_t live = 0;
+  size_t peak = 0;
+  size_t count = 0;
+
+  while (file.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+    if (count++ == 0) {
+      start_ns = record.time_ns;
+    }
+
+    time_ns = record.time_ns - start_ns;
+
+    if (record.size < 0) {
+      size_t size = static_cast<size_t>(-record.size);
+
+      live -= size < live ? size : live;
+      continue;
+    }
+
+    size_t size = static_cast<size_t>(record.size);
+
+    for (auto& sim : sims) {
+      if (!sim.terminated) {
+        Allocate(&sim, base, live, size, limit, time_ns);
+      }
+    }
+
+    live += size;
+
+    if (live > peak) {
+      peak = live;
+    }
+  }
+
+  std::cout << "records: " << count << "\n";
+  std::cout << "duration: ";
+  PrintTime(time_ns);
+  std::cout << "\n";
+  std::cout << "peak_live_bytes: " << peak << "\n";
+  std::cout << "limit: " << limit << ", base: " << base << "\n";
+  std::cout << "\n";
+
+  for (const auto& sim : sims) {
+    Report(sim);
+  }
+
+  return 0;
+}